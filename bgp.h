@@ -22,9 +22,40 @@
 #define MP_REACH_NLRI    14
 #define MP_UNREACH_NLRI  15
 #define EXTENDED_COMMUNITY 16
+#define AS4_PATH         17
 #define LARGE_COMMUNITY  32
 
 #define AS_SEQ 2
+#define AS_TRANS 23456
+
+/* message types */
+#define BGP_MSG_OPEN         1
+#define BGP_MSG_UPDATE       2
+#define BGP_MSG_NOTIFICATION 3
+#define BGP_MSG_KEEPALIVE    4
+
+/* notification codes */
+#define BGP_NOTIFY_OPEN_ERROR    2
+#define BGP_NOTIFY_CEASE         6
+#define BGP_OPEN_BAD_HOLD_TIME   6
+#define BGP_OPEN_UNSUPPORTED_CAP 7
+#define BGP_CEASE_ADMIN_SHUTDOWN 2
+
+/* OPEN capabilities */
+#define BGP_OPT_PARAM_CAPABILITY 2
+#define BGP_CAP_MP               1
+#define BGP_CAP_AS4              65
+#define BGP_CAP_ADD_PATH         69
+#define BGP_ADD_PATH_RECEIVE     1
+#define BGP_ADD_PATH_SEND        2
+
+#define BGP_MARKER_LEN  16
+#define BGP_HEADER_LEN  19
+#define BGP_MAX_MSG_LEN 4096
+
+/* IANA address family identifiers */
+#define AFI_IPV4 1
+#define AFI_IPV6 2
 
 #define SAFI_UNICAST       1
 #define SAFI_LABEL_UNICAST 4
@@ -8,6 +8,7 @@
 
 /* type */
 #define MRT_TABLE_DUMP_V2 13
+#define MRT_BGP4MP        16
 
 /* subtype */
 #define MRT_PEER_INDEX_TABLE 1
@@ -15,5 +16,16 @@
 #define MRT_RIB_IPV6_UNICAST 4
 #define MRT_RIB_GENERIC      6
 
+/* RFC 8050 ADD-PATH subtypes */
+#define MRT_RIB_IPV4_UNICAST_ADDPATH   8
+#define MRT_RIB_IPV4_MULTICAST_ADDPATH 9
+#define MRT_RIB_IPV6_UNICAST_ADDPATH   10
+#define MRT_RIB_IPV6_MULTICAST_ADDPATH 11
+#define MRT_RIB_GENERIC_ADDPATH        12
+
+/* BGP4MP subtype */
+#define MRT_BGP4MP_MESSAGE_AS4         4
+#define MRT_BGP4MP_MESSAGE_AS4_ADDPATH 9 /* RFC 8050 */
+
 #define MRT_PEER_TYPE_AS4  0x2
 #define MRT_PEER_TYPE_IPV6 0x1
@@ -30,6 +30,35 @@ const char banner[] = "\n"
 "   / /  / / _, _/ / / / /_/ /  __/ / / /        / \n"
 "  /_/  /_/_/ |_| /_/  \\____/\\___/_/ /_/\n\n";
 
+/*
+ * Output format name translation table.
+ */
+struct keyval_ format_names[] = {
+    { FORMAT_MRT,    "mrt" },
+    { FORMAT_UPDATE, "update" },
+    { 0, NULL}
+};
+
+/*
+ * Prefix pattern name translation table, --pattern names to PATTERN_*.
+ */
+struct keyval_ pattern_names[] = {
+    { PATTERN_LINEAR,  "linear" },
+    { PATTERN_NESTED,  "nested" },
+    { PATTERN_SCATTER, "scatter" },
+    { PATTERN_SIBLING, "sibling" },
+    { 0, NULL}
+};
+
+/*
+ * Output order name translation table, --order names to ORDER_*.
+ */
+struct keyval_ order_names[] = {
+    { ORDER_LINEAR,  "linear" },
+    { ORDER_GROUPED, "grouped" },
+    { 0, NULL}
+};
+
 /*
  * Log target / name translation table.
  */
@@ -62,7 +91,7 @@ keyval_get_key (struct keyval_ *keyval, int val)
 char *
 log_format_timestamp (void)
 {
-    static char ts_str[sizeof("Dec 24 08:07:13.711541")];
+    static __thread char ts_str[sizeof("Dec 24 08:07:13.711541")];
     struct timespec now;
     struct tm tm;
     int len;
@@ -148,15 +177,40 @@ format_nexthop (rib_entry_t *re)
  */
 static struct option long_options[] = {
     { "as-base",            required_argument,  NULL, 'a' },
+    { "as2",                no_argument,        NULL, '2' },
+    { "path-num",           required_argument,  NULL, 'A' },
+    { "bgp-peer",           required_argument,  NULL, 'b' },
+    { "chunk-size",         required_argument,  NULL, 'c' },
+    { "chunk-num",          required_argument,  NULL, 'C' },
+    { "delta-from",         required_argument,  NULL, 'x' },
+    { "direct",             no_argument,        NULL, 'd' },
+    { "cache-dir",          required_argument,  NULL, 'D' },
+    { "stats-file",         required_argument,  NULL, 'F' },
+    { "format",             required_argument,  NULL, 'f' },
+    { "progress",           required_argument,  NULL, 'g' },
     { "help",               no_argument,        NULL, 'h' },
+    { "input",              required_argument,  NULL, 'i' },
+    { "threads",            required_argument,  NULL, 'j' },
+    { "pin",                required_argument,  NULL, 'K' },
+    { "perf",               no_argument,        NULL, 'E' },
     { "log",                required_argument,  NULL, 't' },
     { "local-preference",   required_argument,  NULL, 'l' },
     { "label-base",         required_argument,  NULL, 'm' },
+    { "manifest",           no_argument,        NULL, 'M' },
     { "nexthop-base",       required_argument,  NULL, 'n' },
     { "nexthop-num",        required_argument,  NULL, 'N' },
+    { "order",              required_argument,  NULL, 'O' },
+    { "pattern",            required_argument,  NULL, 'T' },
     { "prefix-base",        required_argument,  NULL, 'p' },
     { "prefix-num",         required_argument,  NULL, 'P' },
+    { "peer-as",            required_argument,  NULL, 'Q' },
+    { "range",              required_argument,  NULL, 'r' },
+    { "server",             required_argument,  NULL, 'S' },
+    { "server-cache",       required_argument,  NULL, 'G' },
+    { "sweep",              required_argument,  NULL, 'w' },
+    { "timestamp",          required_argument,  NULL, 'e' },
     { "verbose",            no_argument,        NULL, 'v' },
+    { "zerocopy",           no_argument,        NULL, 'z' },
     { NULL,                 0,                  NULL,  0 }
 };
 
@@ -169,9 +223,19 @@ mrtgen_print_usage_arg (struct option *option)
 
     if (option->has_arg == 1) {
 
+	ptr = NULL;
 	if (strcmp(option->name, "log") == 0) {
-	    len = 0;
 	    ptr = log_names;
+	} else if (strcmp(option->name, "format") == 0) {
+	    ptr = format_names;
+	} else if (strcmp(option->name, "pattern") == 0) {
+	    ptr = pattern_names;
+	} else if (strcmp(option->name, "order") == 0) {
+	    ptr = order_names;
+	}
+
+	if (ptr) {
+	    len = 0;
 	    while (ptr->key) {
 		len += snprintf(buf+len, sizeof(buf)-len, "%s%s", len ? "|" : " ", ptr->key);
 		ptr++;
@@ -241,7 +305,10 @@ mrtgen_init_ctx (ctx_t *ctx)
     inet_pton(AF_INET, "172.16.0.0", &ctx->base.nexthop.v4);
 
     /* Write buffer */
-    ctx->write_buf = malloc(WRITEBUFSIZE);
+    ctx->write_buf = malloc(RECORDBUFSIZE);
+    ctx->write_size = RECORDBUFSIZE;
+    ctx->chunk_size = CHUNKSIZE;
+    ctx->chunk_num = CHUNKNUM;
 
     /* MRT must haves */
     time(&ctx->now);
@@ -256,58 +323,263 @@ mrtgen_log_ctx (ctx_t *ctx)
     LOG(NORMAL, "MRT prefix generation parameters for file %s\n", ctx->filename);
     LOG(NORMAL, " Origin %s\n", keyval_get_key(bgp_origin_types, ctx->base.origin));
     LOG(NORMAL, " Base AS %u\n", ctx->base.as_path[0]);
-    LOG(NORMAL, " Base Prefix %s, %u prefixes\n", format_prefix(&ctx->base), ctx->num_prefixes);
+    if (ctx->input) {
+	LOG(NORMAL, " Rewrite %s, base prefix %s\n", ctx->input, format_prefix(&ctx->base));
+    } else {
+	LOG(NORMAL, " Base Prefix %s, %u prefixes\n", format_prefix(&ctx->base), ctx->num_prefixes);
+    }
+    if (ctx->seq_start || ctx->seq_end < ctx->num_prefixes) {
+	LOG(NORMAL, " Range %u:%u\n", ctx->seq_start, ctx->seq_end - ctx->seq_start);
+    }
+    if (ctx->pattern != PATTERN_LINEAR) {
+	LOG(NORMAL, " Prefix pattern %s\n", keyval_get_key(pattern_names, ctx->pattern));
+    }
     LOG(NORMAL, " Base Nexthop %s, %u nexthops\n", format_nexthop(&ctx->base), ctx->num_nexthops);
+    if (ctx->order != ORDER_LINEAR) {
+	LOG(NORMAL, " Order %s\n", keyval_get_key(order_names, ctx->order));
+    }
+    if (ctx->num_paths) {
+	LOG(NORMAL, " ADD-PATH, %u paths per prefix\n", ctx->num_paths);
+    }
+    LOG(NORMAL, " Format %s%s\n", keyval_get_key(format_names, ctx->format),
+	ctx->format == FORMAT_UPDATE && ctx->as2 ? ", 2-byte AS" : "");
     if (ctx->base.label[0]) {
 	LOG(NORMAL, " Base label %u\n", ctx->base.label[0]);
     }
     if (ctx->base.localpref) {
 	LOG(NORMAL, " Local preference %u\n", ctx->base.localpref);
     }
+    if (ctx->num_threads) {
+	LOG(NORMAL, " Pipeline, %u encoder threads\n", ctx->num_threads);
+    }
+}
+
+/*
+ * Run summary of the performance counters, per phase and per route.
+ * Encoding is what writing spent outside of flushes.
+ */
+void
+mrtgen_log_perf (ctx_t *ctx)
+{
+    perf_sample_t *phase, encode;
+    double total;
+
+    phase = ctx->perf_phase;
+    memset(&encode, 0, sizeof(encode));
+    mrtgen_perf_add(&encode, &phase[PERF_PHASE_FLUSH], &phase[PERF_PHASE_WRITE]);
+
+    total = (phase[PERF_PHASE_GENERATE].nsec + phase[PERF_PHASE_WRITE].nsec) / 1e9;
+    LOG(NORMAL, "Perf %u rib-entries in %.3fs, %.0f routes/sec\n", ctx->write_count, total,
+	total > 0 ? ctx->write_count / total : 0);
+    if (phase[PERF_PHASE_GENERATE].nsec) {
+	LOG(NORMAL, " generate %.3fs, %s\n", phase[PERF_PHASE_GENERATE].nsec / 1e9,
+	    mrtgen_perf_format(&phase[PERF_PHASE_GENERATE], ctx->write_count));
+    }
+    LOG(NORMAL, " encode %.3fs, %s\n", encode.nsec / 1e9,
+	mrtgen_perf_format(&encode, ctx->write_count));
+    LOG(NORMAL, " flush %.3fs, %s\n", phase[PERF_PHASE_FLUSH].nsec / 1e9,
+	mrtgen_perf_format(&phase[PERF_PHASE_FLUSH], ctx->write_count));
+}
+
+/*
+ * Parse a decimal option value within [min, max].
+ */
+static int
+mrtgen_parse_uint (const char *name, const char *arg, unsigned long min, unsigned long max, uint *val)
+{
+    unsigned long num;
+    char *end;
+
+    errno = 0;
+    num = strtoul(arg, &end, 10);
+    if (errno || end == arg || *end || strchr(arg, '-') || num < min || num > max) {
+	LOG(ERROR, "Invalid %s '%s', expected %lu..%lu\n", name, arg, min, max);
+	return -1;
+    }
+    *val = num;
+    return 0;
 }
 
+/*
+ * Parse the command line options into the context.
+ * return -1 on invalid or help options.
+ */
 int
-main (int argc, char *argv[])
+mrtgen_parse_args (ctx_t *ctx, int argc, char *argv[])
 {
+    struct keyval_ *kv;
+    char range[16];
+    uint count, value;
+    char *end;
     int opt, idx;
-    ctx_t ctx;
-
-    /*
-     * Init default options.
-     */
-    mrtgen_init_ctx(&ctx);
-    log_id[NORMAL].enable = true;
-    log_id[ERROR].enable = true;
 
-    /*
-     * Parse options.
-     */
     idx = 0;
-    while ((opt = getopt_long(argc, argv,"a:t:l:m:n:N:p:P:hv", long_options, &idx )) != -1) {
+    optind = 0;
+    while ((opt = getopt_long(argc, argv,"a:2A:b:c:C:dD:e:Ef:F:g:G:i:j:K:t:T:l:m:Mn:N:O:p:P:Q:r:S:hvw:x:z", long_options, &idx )) != -1) {
         switch (opt) {
         case 't':
 	    /* logging */
+	    if (ctx->parse_restricted) {
+		LOG(ERROR, "Logging options are process wide, not supported here\n");
+		return -1;
+	    }
 	    log_enable(optarg);
 	    break;
 
 	case 'a':
 	    /* base AS */
-	    ctx.base.as_path[0] = atoi(optarg);
+	    ctx->base.as_path[0] = atoi(optarg);
+	    break;
+
+	case '2':
+	    /* no AS4 capability */
+	    ctx->as2 = true;
+	    break;
+
+	case 'A':
+	    /* number of ADD-PATH paths */
+	    if (mrtgen_parse_uint("ADD-PATH paths", optarg, 1, 65535, &ctx->num_paths) != 0) {
+		return -1;
+	    }
+	    break;
+
+	case 'b':
+	    /* BGP speaker mode */
+	    ctx->bgp_peer = optarg;
+	    break;
+
+	case 'c':
+	    /* output chunk size */
+	    if (mrtgen_parse_uint("chunk size", optarg, 1, UINT_MAX, &ctx->chunk_size) != 0) {
+		return -1;
+	    }
+	    break;
+
+	case 'C':
+	    /* number of output chunks */
+	    if (mrtgen_parse_uint("chunk number", optarg, 1, UINT_MAX, &ctx->chunk_num) != 0) {
+		return -1;
+	    }
+	    break;
+
+	case 'd':
+	    /* O_DIRECT output */
+	    ctx->direct = true;
+	    break;
+
+	case 'D':
+	    /* on-disk cache */
+	    ctx->cache_dir = optarg;
+	    break;
+
+	case 'e':
+	    /* MRT timestamp, identical across independently generated slices */
+	    if (mrtgen_parse_uint("timestamp", optarg, 0, UINT32_MAX, &value) != 0) {
+		return -1;
+	    }
+	    ctx->now = value;
+	    ctx->now_fixed = true;
+	    break;
+
+	case 'E':
+	    /* hardware performance counters */
+	    ctx->perf = true;
+	    break;
+
+	case 'f':
+	    /* output format */
+	    if (strcmp(optarg, "mrt") == 0) {
+		ctx->format = FORMAT_MRT;
+	    } else if (strcmp(optarg, "update") == 0) {
+		ctx->format = FORMAT_UPDATE;
+	    } else {
+		return -1;
+	    }
+	    break;
+
+	case 'F':
+	    /* progress stats file */
+	    ctx->stats_file = optarg;
+	    if (!ctx->progress_interval) {
+		ctx->progress_interval = 1;
+	    }
+	    break;
+
+	case 'g':
+	    /* progress reporting interval */
+	    ctx->progress_interval = atoi(optarg);
+	    break;
+
+	case 'G':
+	    /* server mode cache budget */
+	    if (mrtgen_parse_uint("server cache MB", optarg, 1, UINT_MAX, &ctx->server_cache) != 0) {
+		return -1;
+	    }
+	    break;
+
+	case 'i':
+	    /* rewrite mode input file */
+	    ctx->input = optarg;
+	    break;
+
+	case 'j':
+	    /* pipeline encoder threads */
+	    if (mrtgen_parse_uint("encoder threads", optarg, 0, PIPELINE_CPUS_MAX, &ctx->num_threads) != 0) {
+		return -1;
+	    }
+	    break;
+
+	case 'K':
+	    /* pin pipeline stages */
+	    if (mrtgen_parse_cpus(ctx, optarg) != 0) {
+		return -1;
+	    }
+	    break;
+
+	case 'O':
+	    /* output ordering */
+	    for (kv = order_names; kv->key; kv++) {
+		if (strcmp(optarg, kv->key) == 0) {
+		    break;
+		}
+	    }
+	    if (!kv->key) {
+		return -1;
+	    }
+	    ctx->order = kv->val;
+	    break;
+
+	case 'T':
+	    /* prefix pattern */
+	    for (kv = pattern_names; kv->key; kv++) {
+		if (strcmp(optarg, kv->key) == 0) {
+		    break;
+		}
+	    }
+	    if (!kv->key) {
+		return -1;
+	    }
+	    ctx->pattern = kv->val;
 	    break;
 
 	case 'm':
 	    /* base label */
-	    ctx.base.label[0] = atoi(optarg);
+	    ctx->base.label[0] = atoi(optarg);
+	    break;
+
+	case 'M':
+	    /* output manifest */
+	    ctx->manifest = true;
 	    break;
 
 	case 'l':
 	    /* localpref */
-	    ctx.base.localpref = atoi(optarg);
+	    ctx->base.localpref = atoi(optarg);
 	    break;
 
         case 'P':
 	    /* number of prefixes */
-	    ctx.num_prefixes = atoi(optarg);
+	    ctx->num_prefixes = atoi(optarg);
 	    break;
 
 	case 'p':
@@ -316,79 +588,335 @@ main (int argc, char *argv[])
 		char *tok;
 
 		tok = strtok(optarg, "/");
-		if (tok && inet_pton(AF_INET, tok, &ctx.base.prefix.v4)) {
-		    ctx.base.prefix_afi = AF_INET;
-		} else if (tok && inet_pton(AF_INET6, tok, &ctx.base.prefix.v6)) {
-		    ctx.base.prefix_afi = AF_INET6;
+		if (tok && inet_pton(AF_INET, tok, &ctx->base.prefix.v4)) {
+		    ctx->base.prefix_afi = AF_INET;
+		} else if (tok && inet_pton(AF_INET6, tok, &ctx->base.prefix.v6)) {
+		    ctx->base.prefix_afi = AF_INET6;
 		}
 		tok = strtok(NULL, "/");
 		if (tok) {
-		    ctx.base.prefix_len = atoi(tok);
+		    ctx->base.prefix_len = atoi(tok);
 		}
 	    }
 	    break;
 
 	case 'N':
 	    /* number of nexthops */
-	    ctx.num_nexthops = atoi(optarg);
+	    ctx->num_nexthops = atoi(optarg);
 	    break;
 
 	case 'n':
 	    /* base nexthop */
-	    if (inet_pton(AF_INET, optarg, &ctx.base.nexthop.v4)) {
-		ctx.base.nexthop_afi = AF_INET;
-	    } else if (inet_pton(AF_INET6, optarg, &ctx.base.nexthop.v6)) {
-		ctx.base.nexthop_afi = AF_INET6;
+	    if (inet_pton(AF_INET, optarg, &ctx->base.nexthop.v4)) {
+		ctx->base.nexthop_afi = AF_INET;
+	    } else if (inet_pton(AF_INET6, optarg, &ctx->base.nexthop.v6)) {
+		ctx->base.nexthop_afi = AF_INET6;
+	    }
+	    break;
+
+	case 'Q':
+	    /* peer AS of the peer table */
+	    ctx->peer_as = strtoul(optarg, NULL, 10);
+	    break;
+
+	case 'r':
+	    /* range of sequences, START:COUNT */
+	    end = strchr(optarg, ':');
+	    if (!end || end - optarg >= (int)sizeof(range)) {
+		LOG(ERROR, "Invalid range '%s', expected START:COUNT\n", optarg);
+		return -1;
+	    }
+	    snprintf(range, sizeof(range), "%.*s", (int)(end - optarg), optarg);
+	    if (mrtgen_parse_uint("range start", range, 0, UINT32_MAX, &value) != 0 ||
+		mrtgen_parse_uint("range count", end + 1, 1, UINT32_MAX - value, &count) != 0) {
+		return -1;
 	    }
+	    ctx->seq_start = value;
+	    ctx->seq_end = value + count;
+	    break;
+
+	case 'S':
+	    /* server mode */
+	    ctx->server = optarg;
 	    break;
 
 	case 'v':
+	    if (ctx->parse_restricted) {
+		LOG(ERROR, "Verbosity is process wide, not supported here\n");
+		return -1;
+	    }
 	    verbose++;
 	    break;
+
+	case 'w':
+	    /* parameter sweep */
+	    if (mrtgen_parse_sweep(ctx, optarg) != 0) {
+		return -1;
+	    }
+	    break;
+
+	case 'x':
+	    /* delta mode, parameter set of the current table */
+	    ctx->delta_from = optarg;
+	    break;
+
+	case 'z':
+	    /* zerocopy sends in BGP speaker mode */
+	    ctx->bgp_zerocopy = true;
+	    break;
 	case 'h': /* fall through */
 	default:
-	    mrtgen_print_usage();
-	    exit(EXIT_FAILURE);
+	    return -1;
         }
     }
 
+    /*
+     * Without a range the entire table gets generated.
+     */
+    if (!ctx->seq_end) {
+	ctx->seq_start = 0;
+	ctx->seq_end = ctx->num_prefixes;
+    } else if (ctx->seq_end > ctx->num_prefixes || ctx->seq_end < ctx->seq_start) {
+	return -1;
+    }
+
+    /*
+     * IPv4 routes carry their nexthop in NEXT_HOP, which has no room for IPv6.
+     */
+    if (ctx->base.prefix_afi == AF_INET && ctx->base.nexthop_afi == AF_INET6) {
+	LOG(ERROR, "IPv4 prefixes require an IPv4 nexthop\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    ctx_t ctx;
+    int res;
+
+    /*
+     * Init default options.
+     */
+    mrtgen_init_ctx(&ctx);
+    log_id[NORMAL].enable = true;
+    log_id[ERROR].enable = true;
+
+    /*
+     * Parse options.
+     */
+    if (mrtgen_parse_args(&ctx, argc, argv) != 0) {
+	mrtgen_print_usage();
+	exit(EXIT_FAILURE);
+    }
+
     printf("%s", banner);
 
+    /*
+     * Server mode. Parameter sets are supplied per connection.
+     */
+    if (ctx.server) {
+	mrtgen_server(&ctx);
+	return 0;
+    }
+
+    /*
+     * The BGP speaker sends raw UPDATEs of a single table to a single peer.
+     */
+    if (ctx.bgp_peer) {
+	if (ctx.sweep_num || ctx.manifest || ctx.num_threads || ctx.input) {
+	    LOG(ERROR, "BGP speaker mode supports neither sweep, manifest, threads nor input\n");
+	    exit(EXIT_FAILURE);
+	}
+	ctx.format = FORMAT_UPDATE;
+    }
+
+    /*
+     * TABLE_DUMP_V2 always carries 4-byte ASNs.
+     */
+    if (ctx.as2 && ctx.format == FORMAT_MRT) {
+	LOG(ERROR, "--as2 requires the update format\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Rewritten tables depend on the input, hence are neither cached nor swept.
+     * The input gets streamed in order, hence neither ranges nor pipeline.
+     * TABLE_DUMP_V2 input carries unicast RIBs only.
+     */
+    if (ctx.input) {
+	if (ctx.sweep_num || ctx.seq_start || ctx.seq_end < ctx.num_prefixes) {
+	    LOG(ERROR, "Rewrite mode supports neither sweep nor range\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (ctx.base.prefix_safi != 1) {
+	    LOG(ERROR, "Rewrite mode requires a unicast base prefix\n");
+	    exit(EXIT_FAILURE);
+	}
+	ctx.cache_dir = NULL;
+	ctx.num_threads = 0;
+    }
+
+    /*
+     * A delta depends on two parameter sets, hence is neither cached nor swept.
+     * Both tables get merged in order, hence neither ranges nor pipeline.
+     */
+    if (ctx.delta_from) {
+	if (ctx.sweep_num || ctx.input || ctx.seq_start || ctx.seq_end < ctx.num_prefixes) {
+	    LOG(ERROR, "Delta mode supports neither sweep, input nor range\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (ctx.order != ORDER_LINEAR) {
+	    LOG(ERROR, "Delta mode requires linear order\n");
+	    exit(EXIT_FAILURE);
+	}
+	ctx.cache_dir = NULL;
+	ctx.num_threads = 0;
+    }
+
+    /*
+     * A range is a slice of the table, hence not cached.
+     */
+    if (ctx.seq_start || ctx.seq_end < ctx.num_prefixes) {
+	if (ctx.sweep_num) {
+	    LOG(ERROR, "Sweep requires the entire table, no range\n");
+	    exit(EXIT_FAILURE);
+	}
+	ctx.cache_dir = NULL;
+    }
+
+    /*
+     * A sweep generates the largest table, smaller ones are prefixes of it.
+     * Its files are written by a sink, hence neither cached nor direct.
+     */
+    if (ctx.sweep_num) {
+	if (ctx.order != ORDER_LINEAR) {
+	    LOG(ERROR, "Sweep requires linear order, grouped tables are no prefixes of each other\n");
+	    exit(EXIT_FAILURE);
+	}
+	ctx.num_prefixes = ctx.sweep[ctx.sweep_num-1].num_prefixes;
+	ctx.seq_end = ctx.num_prefixes;
+	ctx.cache_dir = NULL;
+	ctx.direct = false;
+    }
+
     /*
      * Log configured options
      */
     mrtgen_log_ctx(&ctx);
 
     /*
-     * Generate RIB
+     * Pick the RIB entry encoder.
      */
-    mrtgen_generate_rib(&ctx);
+    mrtgen_select_encoder(&ctx);
 
     /*
-     * Open file
+     * BGP speaker mode. Blast the RIB to a peer.
      */
-    ctx.file = fopen(ctx.filename, "w");
-    if (!ctx.file) {
-	LOG(ERROR, "Could not open MRT file %s", ctx.filename);
+    if (ctx.bgp_peer) {
+	ctx.filename = ctx.bgp_peer;
+	if (!ctx.delta_from) {
+	    mrtgen_generate_rib(&ctx);
+	}
+	res = -1;
+	if (mrtgen_init_chunks(&ctx) == 0) {
+	    res = mrtgen_bgp_speaker(&ctx);
+	    mrtgen_free_chunks(&ctx);
+	}
+	mrtgen_delete_rib(&ctx);
+	free(ctx.write_buf);
+	return res ? EXIT_FAILURE : 0;
+    }
+
+    /*
+     * Open file. Serve from the cache if possible.
+     */
+    if (ctx.manifest) {
+	mrtgen_manifest_init(&ctx);
+    }
+    if (ctx.sweep_num) {
+	if (mrtgen_open_sweep(&ctx) != 0) {
+	    return 0;
+	}
+    } else if (ctx.cache_dir) {
+	res = mrtgen_cache_open(&ctx);
+	if (res == 1 && ctx.manifest && mrtgen_manifest_read(&ctx, ctx.filename) == 0) {
+	    mrtgen_manifest_write(&ctx);
+	}
+	if (res != 0) {
+	    free(ctx.write_buf);
+	    return 0;
+	}
+    } else if (mrtgen_open_output(&ctx) != 0) {
 	return 0;
     }
-    ctx.sockfd = fileno(ctx.file);
-    if (ctx.sockfd == -1) {
-	LOG(ERROR, "Could not set FD for MRT file %s", ctx.filename);
+
+    /*
+     * Open the performance counters. Without any, run uninstrumented.
+     */
+    if (ctx.perf && !mrtgen_perf_open()) {
+	LOG(NORMAL, "Performance counters unavailable\n");
+	ctx.perf = false;
+    }
+
+    /*
+     * Generate RIB. The pipeline generates it on the fly.
+     */
+    if (!ctx.num_threads && !ctx.input && !ctx.delta_from) {
+	mrtgen_perf_start(&ctx, PERF_PHASE_GENERATE);
+	mrtgen_generate_rib(&ctx);
+	mrtgen_perf_stop(&ctx, PERF_PHASE_GENERATE);
+    }
+
+    /*
+     * Allocate output chunks.
+     */
+    if (mrtgen_init_chunks(&ctx) != 0) {
 	return 0;
     }
 
     /*
      * Write RIB
      */
-    mrtgen_write_rib(&ctx);
+    mrtgen_progress_start(&ctx);
+    mrtgen_perf_start(&ctx, PERF_PHASE_WRITE);
+    res = 0;
+    if (ctx.input) {
+	res = mrtgen_input_write_rib(&ctx);
+    } else if (ctx.delta_from) {
+	res = mrtgen_delta_write_rib(&ctx);
+    } else if (ctx.num_threads) {
+	mrtgen_pipeline_write_rib(&ctx);
+    } else {
+	mrtgen_write_rib(&ctx);
+    }
+    mrtgen_perf_stop(&ctx, PERF_PHASE_WRITE);
+    mrtgen_progress_stop(&ctx);
+    if (ctx.perf) {
+	mrtgen_log_perf(&ctx);
+	mrtgen_perf_close();
+    }
 
     /*
      * Flush and close all we have.
      */
     mrtgen_delete_rib(&ctx);
+    mrtgen_free_chunks(&ctx);
     free(ctx.write_buf);
-    fclose(ctx.file);
+    if (ctx.sweep_num) {
+	mrtgen_close_sweep(&ctx);
+    } else if (ctx.cache_dir) {
+	if (mrtgen_cache_close(&ctx) != 0) {
+	    return 0;
+	}
+    } else {
+	mrtgen_close_output(&ctx);
+    }
+    if (ctx.manifest) {
+	mrtgen_manifest_write(&ctx);
+    }
 
-    return 0;
+    return res ? EXIT_FAILURE : 0;
 }
@@ -19,9 +19,17 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include "perf.h"
 
-#define WRITEBUFSIZE 1024*256
+#define RECORDBUFSIZE 4096       /* initial record buffer, grows on demand */
+#define CHUNKSIZE     1024*256   /* default output chunk size */
+#define CHUNKNUM      16         /* default number of output chunks */
+#define DIRECT_ALIGN  4096       /* O_DIRECT buffer, size and offset alignment */
+#define HUGEPAGESIZE  1024*1024*2
+#define MANIFEST_BLOCKSIZE 1024*1024*4 /* checksummed output block */
+#define PIPELINE_CPUS_MAX 64     /* pinned pipeline stages */
 
 /*
  * Logging
@@ -92,6 +100,87 @@ __attribute__ ((__packed__)) struct rib_entry_ {
 
 typedef struct rib_entry_ rib_entry_t;
 
+/*
+ * Output chunk. Records are appended to a chain of chunks,
+ * once all chunks are full the chain gets flushed using a single writev().
+ */
+struct chunk_ {
+    u_char *buf;
+    uint idx; /* fill level */
+};
+
+typedef struct chunk_ chunk_t;
+
+/*
+ * Sweep output. One file per table size, each a byte prefix of the next.
+ */
+struct sweep_ {
+    uint32_t num_prefixes;
+    char *filename;
+    int fd;
+    uint64_t cutoff; /* file size, known once the last record got committed */
+    uint64_t written;
+};
+
+typedef struct sweep_ sweep_t;
+
+/*
+ * Batch encoder state. Records are stamped from a template
+ * and get their sequence, prefix and nexthop patched.
+ */
+#define ENCODER_RECORD_MAX 256   /* largest record of the specialized encoders */
+#define BATCH_RECORDS      64    /* records per batch */
+
+struct batch_ {
+    u_char tmpl[ENCODER_RECORD_MAX];
+    uint len; /* record length */
+    uint nexthop_off;
+    uint prefix_bytes;
+    uint32_t prefix;
+    uint32_t prefix_inc;
+    uint32_t nexthop;
+    uint32_t num_nexthops;
+};
+
+typedef struct batch_ batch_t;
+
+/*
+ * Output formats.
+ */
+enum {
+    FORMAT_MRT,    /* TABLE_DUMP_V2 */
+    FORMAT_UPDATE  /* raw, fully framed BGP UPDATE messages */
+};
+
+/*
+ * Prefix patterns. All but linear compute the prefix from the sequence.
+ */
+enum {
+    PATTERN_LINEAR,  /* increment by one base prefix length block */
+    PATTERN_NESTED,  /* covering chains from the base length down to host routes */
+    PATTERN_SCATTER, /* base length prefixes permuted across the address space */
+    PATTERN_SIBLING  /* sibling pairs, pairs never adjacent */
+};
+
+/*
+ * Output orderings. Both emit the same routes.
+ */
+enum {
+    ORDER_LINEAR,  /* by sequence, nexthops rotate per route */
+    ORDER_GROUPED  /* routes sharing a nexthop, hence all attributes, are adjacent */
+};
+
+/*
+ * Performance counter phases. Flushes happen while writing,
+ * encoding is what writing spends outside of flushes.
+ */
+enum {
+    PERF_PHASE_GENERATE,
+    PERF_PHASE_WRITE,
+    PERF_PHASE_FLUSH,
+    PERF_PHASE_MAX
+};
+
 /*
  * Top level object.
  */
@@ -102,20 +191,96 @@ __attribute__ ((__packed__)) struct ctx_ {
 
     uint32_t num_prefixes; /* To be generated prefixes */
     uint32_t num_nexthops; /* Nexthop limit */
+    uint32_t num_paths; /* ADD-PATH paths per prefix, 0 for no ADD-PATH */
+    uint32_t seq_start; /* First sequence to be generated */
+    uint32_t seq_end; /* Sequence past the last one to be generated */
+    char *input; /* rewrite mode, TABLE_DUMP_V2 file supplying the prefixes */
+    char *delta_from; /* delta mode, parameter set of the current table */
+    uint8_t pattern; /* prefix pattern */
+    uint8_t order; /* output ordering */
+
+    /* output format */
+    uint8_t format;
+    bool as2; /* no AS4 capability, 2-byte AS_PATH plus AS4_PATH */
+    uint32_t path_id; /* first ADD-PATH path of the current UPDATE */
+    uint32_t path_cnt; /* number of ADD-PATH paths of the current UPDATE */
 
     rib_entry_t base; /* Fill out for all base values */
+    uint as_path_len; /* AS path length of the base */
+
+    /* RIB entry encoder, specialized for the base profile */
+    void (*write_ribentry)(struct ctx_ *, rib_entry_t *);
+
+    /* batch encoder, set if records are of constant shape */
+    void (*write_batch)(struct ctx_ *, uint32_t, uint);
+    batch_t batch;
 
     /* MRT file */
     char *filename;
     FILE *file;
     int sockfd;
+    bool direct; /* O_DIRECT, preallocated output */
+    char *server; /* server mode socket, UNIX path or [addr:]port */
+    uint server_cache; /* server mode cache budget in MB, 0 for the default */
+    bool parse_restricted; /* reject options with process wide effects, -t and -v */
+    char *bgp_peer; /* BGP speaker mode, addr, addr:port or [v6-addr]:port */
+    bool bgp_zerocopy; /* MSG_ZEROCOPY sends to the BGP peer */
+
+    /* on-disk cache */
+    char *cache_dir;
+    char cache_key[17];
+    char cache_tmp[PATH_MAX];
+
+    /* output sink, replaces writing to sockfd if set */
+    int (*sink)(struct ctx_ *, struct iovec *, uint);
+    void *sink_arg;
 
-    /* write buffer */
+    /* record buffer */
     u_char *write_buf;
     uint write_idx;
+    uint write_size;
+
+    /* output chunk chain */
+    chunk_t *chunk;
+    uint chunk_size;
+    uint chunk_num;
+    uint chunk_cur;
+    u_char *chunk_mem;
+    size_t chunk_mem_size;
+    uint64_t write_bytes; /* committed record bytes */
+    bool write_error; /* a flush failed, the output is incomplete */
+    uint32_t write_count; /* written RIB entries */
+
+    /* pipeline, 0 encoder threads for sequential operation */
+    uint num_threads;
+    int cpus[PIPELINE_CPUS_MAX]; /* generator, encoders, writer */
+    uint num_cpus;
+
+    /* performance counters */
+    bool perf;
+    perf_sample_t perf_phase[PERF_PHASE_MAX];
+    perf_sample_t perf_mark[PERF_PHASE_MAX];
+
+    /* progress reporting */
+    uint progress_interval; /* seconds, 0 for none */
+    char *stats_file;
+
+    /* parameter sweep, ascending table sizes */
+    sweep_t *sweep;
+    uint sweep_num;
+    uint sweep_next; /* next cutoff to record */
+
+    /* output manifest */
+    bool manifest;
+    uint32_t *block_crc;
+    uint block_num;
+    uint block_max;
+    uint block_fill;
+    uint32_t block_crc_cur;
 
     /* epoch */
     time_t now;
+    bool now_fixed; /* --timestamp, part of the cache key */
 
     /* MRT peertable */
     uint8_t peer_id[4];
@@ -139,11 +304,61 @@ typedef struct ctx_ ctx_t;
  */
 char *format_prefix(rib_entry_t *);
 char *format_nexthop(rib_entry_t *);
+void mrtgen_reserve_buf(ctx_t *, uint);
+void mrtgen_commit_record(ctx_t *);
+void write_be_uint(u_char *, uint, unsigned long long);
+void push_be_uint(ctx_t *, uint, unsigned long long);
+__uint128_t mrtgen_load_addr(uint8_t *, uint);
+void mrtgen_store_addr(__uint128_t, uint8_t *, uint);
+void mrtgen_log_rib(rib_entry_t *);
+void mrtgen_push_addr(ctx_t *, uint8_t *, uint);
+void mrtgen_push_prefix(ctx_t *, rib_entry_t *);
+void mrtgen_write_pa(ctx_t *, rib_entry_t *);
+uint mrtgen_get_afi(uint);
+void mrtgen_write_update(ctx_t *, rib_entry_t *);
+bool mrtgen_bgp_next_paths(ctx_t *);
+void mrtgen_write_update_msg(ctx_t *, rib_entry_t *);
+void mrtgen_write_withdraw_msg(ctx_t *, rib_entry_t *);
+void mrtgen_write_peertable(ctx_t *);
+void mrtgen_seq_to_entry(ctx_t *, uint32_t, rib_entry_t *);
+uint32_t mrtgen_order_seq(ctx_t *, uint32_t);
+int mrtgen_fflush(ctx_t *);
+off_t mrtgen_predict_size(ctx_t *);
 
 /*
  * External API
  */
 
 void mrtgen_generate_rib(ctx_t *ctx);
+void mrtgen_select_encoder(ctx_t *ctx);
+void mrtgen_init_ctx(ctx_t *ctx);
+int mrtgen_parse_args(ctx_t *ctx, int argc, char *argv[]);
+int mrtgen_server(ctx_t *ctx);
+int mrtgen_bgp_speaker(ctx_t *ctx);
+void mrtgen_select_batch_encoder(ctx_t *);
+void mrtgen_batch_template(ctx_t *);
+void mrtgen_perf_start(ctx_t *, uint);
+void mrtgen_perf_stop(ctx_t *, uint);
+void mrtgen_progress_publish(ctx_t *);
+void mrtgen_progress_start(ctx_t *);
+void mrtgen_progress_stop(ctx_t *);
+void mrtgen_manifest_init(ctx_t *);
+void mrtgen_manifest_update(ctx_t *, const u_char *, size_t);
+int mrtgen_manifest_read(ctx_t *, char *);
+void mrtgen_manifest_write(ctx_t *);
+int mrtgen_cache_open(ctx_t *ctx);
+int mrtgen_cache_close(ctx_t *ctx);
+uint64_t mrtgen_cache_key(ctx_t *ctx);
 void mrtgen_write_rib(ctx_t *ctx);
 void mrtgen_delete_rib(ctx_t *ctx);
+int mrtgen_init_chunks(ctx_t *ctx);
+void mrtgen_free_chunks(ctx_t *ctx);
+int mrtgen_open_output(ctx_t *ctx);
+void mrtgen_close_output(ctx_t *ctx);
+int mrtgen_parse_sweep(ctx_t *, char *);
+int mrtgen_open_sweep(ctx_t *);
+void mrtgen_close_sweep(ctx_t *);
+int mrtgen_parse_cpus(ctx_t *, char *);
+int mrtgen_input_write_rib(ctx_t *);
+int mrtgen_delta_write_rib(ctx_t *);
+void mrtgen_pipeline_write_rib(ctx_t *);
@@ -0,0 +1,202 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Batch RIB entry encoder. For linear IPv4 unicast tables consecutive
+ * records differ only in sequence, prefix and nexthop, all of them a
+ * regular increment of the sequence. A batch of records gets stamped
+ * from a template of the base entry and these three fields get patched.
+ * The AVX2 kernel computes and byte swaps eight records per round,
+ * the scalar kernel one at a time.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "mrtgen.h"
+#include "bgp.h"
+
+#define BATCH_LANES 8
+
+/* record field offsets of the ipv4-unicast encoder */
+#define BATCH_SEQ_OFF    12
+#define BATCH_PREFIX_OFF 17
+
+static inline void
+mrtgen_batch_patch (ctx_t *ctx, u_char *rec, uint32_t seq_be, uint32_t prefix_be, uint32_t nh_be)
+{
+    batch_t *batch;
+
+    batch = &ctx->batch;
+    memcpy(rec + BATCH_SEQ_OFF, &seq_be, 4);
+    memcpy(rec + batch->nexthop_off, &nh_be, 4);
+
+    /*
+     * Short prefixes spill into the entry count, restore it from the template.
+     */
+    memcpy(rec + BATCH_PREFIX_OFF, &prefix_be, 4);
+    if (batch->prefix_bytes < 4) {
+	memcpy(rec + BATCH_PREFIX_OFF + batch->prefix_bytes,
+	       batch->tmpl + BATCH_PREFIX_OFF + batch->prefix_bytes, 4 - batch->prefix_bytes);
+    }
+}
+
+/*
+ * Stamp the template into all slots of the batch.
+ */
+static u_char *
+mrtgen_batch_stamp (ctx_t *ctx, uint count)
+{
+    u_char *start, *rec;
+    uint idx;
+
+    mrtgen_reserve_buf(ctx, count * ctx->batch.len);
+    start = ctx->write_buf + ctx->write_idx;
+    for (idx = 0, rec = start; idx < count; idx++, rec += ctx->batch.len) {
+	memcpy(rec, ctx->batch.tmpl, ctx->batch.len);
+    }
+    ctx->write_idx += count * ctx->batch.len;
+
+    return start;
+}
+
+static void
+mrtgen_write_batch_scalar (ctx_t *ctx, uint32_t seq, uint count)
+{
+    batch_t *batch;
+    u_char *rec;
+    uint32_t nexthop_off;
+    uint idx;
+
+    batch = &ctx->batch;
+    rec = mrtgen_batch_stamp(ctx, count);
+    nexthop_off = batch->num_nexthops > 1 ? seq % batch->num_nexthops : 0;
+
+    for (idx = 0; idx < count; idx++, seq++, rec += batch->len) {
+	mrtgen_batch_patch(ctx, rec, htonl(seq), htonl(batch->prefix + seq * batch->prefix_inc),
+			   htonl(batch->nexthop + nexthop_off));
+	if (++nexthop_off >= batch->num_nexthops) {
+	    nexthop_off = 0;
+	}
+    }
+}
+
+#if defined(__x86_64__)
+/*
+ * Eight records per round. Nexthop offsets wrap at most once per round,
+ * hence this kernel requires either no nexthop rotation or at least eight nexthops.
+ */
+__attribute__((target("avx2")))
+static void
+mrtgen_write_batch_avx2 (ctx_t *ctx, uint32_t seq, uint count)
+{
+    uint32_t seq_be[BATCH_LANES], prefix_be[BATCH_LANES], nh_be[BATCH_LANES];
+    __m256i bswap, lanes, vseq, vprefix, vnh_off, vnh, vnum, vinc, vlanes;
+    batch_t *batch;
+    u_char *rec;
+    uint32_t nexthop_off;
+    uint idx, lane;
+
+    batch = &ctx->batch;
+    rec = mrtgen_batch_stamp(ctx, count);
+
+    bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+			     3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    vlanes = _mm256_set1_epi32(BATCH_LANES);
+    vinc = _mm256_set1_epi32(batch->prefix_inc);
+    vnum = _mm256_set1_epi32(batch->num_nexthops > 1 ? batch->num_nexthops : 1);
+
+    vseq = _mm256_add_epi32(_mm256_set1_epi32(seq), lanes);
+    nexthop_off = batch->num_nexthops > 1 ? seq % batch->num_nexthops : 0;
+    vnh_off = batch->num_nexthops > 1 ?
+	_mm256_add_epi32(_mm256_set1_epi32(nexthop_off), lanes) : _mm256_setzero_si256();
+
+    for (idx = 0; idx < count; idx += BATCH_LANES) {
+
+	/*
+	 * Wrap the nexthop offsets, offset - num if offset >= num.
+	 */
+	vnh_off = _mm256_sub_epi32(vnh_off, _mm256_andnot_si256(
+	    _mm256_cmpgt_epi32(vnum, vnh_off), vnum));
+
+	vprefix = _mm256_add_epi32(_mm256_set1_epi32(batch->prefix), _mm256_mullo_epi32(vseq, vinc));
+	vnh = _mm256_add_epi32(_mm256_set1_epi32(batch->nexthop), vnh_off);
+
+	_mm256_storeu_si256((__m256i *)seq_be, _mm256_shuffle_epi8(vseq, bswap));
+	_mm256_storeu_si256((__m256i *)prefix_be, _mm256_shuffle_epi8(vprefix, bswap));
+	_mm256_storeu_si256((__m256i *)nh_be, _mm256_shuffle_epi8(vnh, bswap));
+
+	for (lane = 0; lane < BATCH_LANES && idx + lane < count; lane++, rec += batch->len) {
+	    mrtgen_batch_patch(ctx, rec, seq_be[lane], prefix_be[lane], nh_be[lane]);
+	}
+
+	vseq = _mm256_add_epi32(vseq, vlanes);
+	if (batch->num_nexthops > 1) {
+	    vnh_off = _mm256_add_epi32(vnh_off, vlanes);
+	}
+    }
+}
+#endif
+
+/*
+ * Select the batch encoder. Only generated linear IPv4 unicast MRT tables in sequence
+ * order, without ADD-PATH, have records of a constant shape, all others stay per record.
+ * Batched tables do not need the RIB to be materialized.
+ */
+void
+mrtgen_select_batch_encoder (ctx_t *ctx)
+{
+    batch_t *batch;
+    rib_entry_t *re;
+
+    batch = &ctx->batch;
+    re = &ctx->base;
+    ctx->write_batch = NULL;
+
+    if (ctx->format != FORMAT_MRT || ctx->pattern != PATTERN_LINEAR ||
+	ctx->order != ORDER_LINEAR || ctx->num_paths || ctx->input ||
+	re->prefix_afi != AF_INET || re->prefix_safi != SAFI_UNICAST ||
+	re->nexthop_afi != AF_INET || re->nexthop_safi != SAFI_UNICAST ||
+	!re->prefix_len || re->prefix_len > 32 || log_id[UPDATE].enable) {
+	return;
+    }
+
+    batch->prefix_bytes = (re->prefix_len + 7) / 8;
+    batch->prefix = mrtgen_load_addr(re->prefix.v4, 4);
+    batch->prefix_inc = (uint64_t)1 << (32 - re->prefix_len); /* /0 wraps like the address */
+    batch->nexthop = mrtgen_load_addr(re->nexthop.v4, 4);
+    batch->num_nexthops = ctx->num_nexthops;
+
+    ctx->write_batch = mrtgen_write_batch_scalar;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2") &&
+	(batch->num_nexthops <= 1 || batch->num_nexthops >= BATCH_LANES)) {
+	ctx->write_batch = mrtgen_write_batch_avx2;
+	LOG(NORMAL, " Batch encoder avx2\n");
+	return;
+    }
+#endif
+    LOG(NORMAL, " Batch encoder scalar\n");
+}
+
+/*
+ * Encode the template, the base entry with the final timestamp.
+ */
+void
+mrtgen_batch_template (ctx_t *ctx)
+{
+    batch_t *batch;
+
+    batch = &ctx->batch;
+    ctx->write_idx = 0;
+    ctx->write_ribentry(ctx, &ctx->base);
+    batch->len = ctx->write_idx;
+    ctx->write_idx = 0;
+    memcpy(batch->tmpl, ctx->write_buf, batch->len);
+    batch->nexthop_off = batch->len - 4 - (ctx->base.localpref ? 7 : 0);
+}
@@ -0,0 +1,496 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Consumer side decode benchmark. Decodes the files mrtgen produced
+ * the way a blaster loading them does, that is walking every record,
+ * path attribute and NLRI, and reports routes/sec and bytes/route
+ * such that output encodings can be compared.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mrt.h"
+#include "bgp.h"
+#include "perf.h"
+
+#define BENCH_RUNS 5
+
+/*
+ * Decode state and results of a single run.
+ */
+struct bench_ {
+    bool addpath; /* raw UPDATE NLRIs carry path identifiers */
+    bool error;
+
+    uint64_t records; /* MRT records or BGP messages */
+    uint64_t routes; /* prefix and path pairs */
+    uint64_t default_routes; /* zero length NLRIs, see bench_file() */
+    uint64_t sum; /* consumes the decoded fields, such that nothing gets optimized away */
+};
+
+typedef struct bench_ bench_t;
+
+static inline uint32_t
+get_be16 (const u_char *buf)
+{
+    return buf[0] << 8 | buf[1];
+}
+
+static inline uint32_t
+get_be32 (const u_char *buf)
+{
+    return (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+/*
+ * Walk a run of NLRIs.
+ * return the number of NLRIs.
+ */
+static uint
+bench_decode_nlri (bench_t *bench, const u_char *buf, uint len, bool addpath)
+{
+    uint idx, plen, count;
+
+    count = 0;
+    idx = 0;
+    while (idx < len) {
+	if (addpath) {
+	    if (idx + 5 > len) {
+		break;
+	    }
+	    bench->sum += get_be32(buf + idx); /* path identifier */
+	    idx += 4;
+	}
+	plen = buf[idx];
+	if (idx + 1 + (plen + 7) / 8 > len) {
+	    break;
+	}
+	bench->sum += plen;
+	if (plen) {
+	    bench->sum += buf[idx + 1]; /* first prefix byte */
+	} else {
+	    bench->default_routes++;
+	}
+	idx += 1 + (plen + 7) / 8;
+	count++;
+    }
+    if (idx != len) {
+	bench->error = true;
+    }
+    return count;
+}
+
+/*
+ * Walk the path attributes, pick the fields a blaster needs.
+ * return the number of MP_REACH NLRIs.
+ */
+static uint
+bench_decode_pa (bench_t *bench, const u_char *buf, uint len, bool addpath)
+{
+    uint idx, type, flags, attr_len, nh_len, count;
+    const u_char *attr;
+
+    count = 0;
+    idx = 0;
+    while (idx + 3 <= len) {
+	flags = buf[idx];
+	type = buf[idx + 1];
+	if (flags & EXTENDED_LENGTH) {
+	    if (idx + 4 > len) {
+		break;
+	    }
+	    attr_len = get_be16(buf + idx + 2);
+	    attr = buf + idx + 4;
+	} else {
+	    attr_len = buf[idx + 2];
+	    attr = buf + idx + 3;
+	}
+	idx = (attr - buf) + attr_len;
+	if (idx > len) {
+	    break;
+	}
+
+	switch (type) {
+	case ORIGIN:
+	    if (attr_len >= 1) {
+		bench->sum += attr[0];
+	    }
+	    break;
+	case AS_PATH:
+	    if (attr_len >= 2) {
+		bench->sum += attr[1]; /* segment length */
+	    }
+	    break;
+	case NEXT_HOP:
+	case LOCAL_PREF: /* fall through */
+	    if (attr_len < 4) {
+		bench->error = true;
+		break;
+	    }
+	    bench->sum += get_be32(attr);
+	    break;
+	case MP_REACH_NLRI:
+	    if (attr_len < 5) {
+		bench->error = true;
+		break;
+	    }
+	    nh_len = attr[3];
+	    if (5 + nh_len > attr_len) {
+		bench->error = true;
+		break;
+	    }
+	    if (nh_len >= 4) {
+		bench->sum += get_be32(attr + 4); /* nexthop, first 4 bytes */
+	    }
+	    count += bench_decode_nlri(bench, attr + 5 + nh_len, attr_len - 5 - nh_len, addpath);
+	    break;
+	default:
+	    break;
+	}
+    }
+    if (idx != len) {
+	bench->error = true;
+    }
+    return count;
+}
+
+/*
+ * TABLE_DUMP_V2. One prefix per record, one route per RIB entry.
+ */
+static void
+bench_decode_mrt (bench_t *bench, const u_char *buf, size_t len)
+{
+    const u_char *rec, *end, *p;
+    uint subtype, rec_len, entries, entry, attr_len, plen;
+    bool addpath, generic;
+
+    rec = buf;
+    while (rec + 12 <= buf + len) {
+	subtype = get_be16(rec + 6);
+	rec_len = get_be32(rec + 8);
+	end = rec + 12 + rec_len;
+	if (end > buf + len || get_be16(rec + 4) != MRT_TABLE_DUMP_V2) {
+	    bench->error = true;
+	    return;
+	}
+	bench->records++;
+
+	addpath = false;
+	switch (subtype) {
+	case MRT_PEER_INDEX_TABLE:
+	    rec = end;
+	    continue;
+	case MRT_RIB_IPV4_UNICAST_ADDPATH:
+	case MRT_RIB_IPV6_UNICAST_ADDPATH:
+	case MRT_RIB_GENERIC_ADDPATH:
+	    addpath = true;
+	    /* fall through */
+	case MRT_RIB_IPV4_UNICAST:
+	case MRT_RIB_IPV6_UNICAST:
+	case MRT_RIB_GENERIC:
+	    break;
+	default:
+	    rec = end;
+	    continue;
+	}
+
+	/*
+	 * Fixed fields, that is sequence, [afi, safi], prefix length.
+	 */
+	p = rec + 12;
+	generic = (subtype == MRT_RIB_GENERIC || subtype == MRT_RIB_GENERIC_ADDPATH);
+	if (p + 4 + (generic ? 3 : 0) + 1 > end) {
+	    bench->error = true;
+	    return;
+	}
+	bench->sum += get_be32(p); /* sequence */
+	p += 4;
+	if (generic) {
+	    bench->sum += get_be16(p) + p[2]; /* afi, safi */
+	    p += 3;
+	}
+	plen = *p;
+	bench->sum += plen;
+	p += 1 + (plen + 7) / 8;
+
+	if (p + 2 > end) {
+	    bench->error = true;
+	    return;
+	}
+	entries = get_be16(p);
+	p += 2;
+	for (entry = 0; entry < entries; entry++) {
+	    if (p + 6 + (addpath ? 4 : 0) + 2 > end) {
+		bench->error = true;
+		return;
+	    }
+	    bench->sum += get_be16(p) + get_be32(p + 2); /* peer index, originated time */
+	    p += 6;
+	    if (addpath) {
+		bench->sum += get_be32(p); /* path identifier */
+		p += 4;
+	    }
+	    attr_len = get_be16(p);
+	    p += 2;
+	    if (p + attr_len > end) {
+		bench->error = true;
+		return;
+	    }
+	    bench_decode_pa(bench, p, attr_len, false);
+	    p += attr_len;
+	    bench->routes++;
+	}
+	rec = end;
+    }
+}
+
+/*
+ * Raw BGP UPDATE messages. One route per NLRI.
+ */
+static void
+bench_decode_update (bench_t *bench, const u_char *buf, size_t len)
+{
+    const u_char *msg, *p;
+    uint msg_len, withdrawn_len, attr_len, count;
+
+    msg = buf;
+    while (msg + BGP_HEADER_LEN <= buf + len) {
+	msg_len = get_be16(msg + BGP_MARKER_LEN);
+	if (msg_len < BGP_HEADER_LEN + 4 || msg + msg_len > buf + len) {
+	    bench->error = true;
+	    return;
+	}
+	bench->records++;
+	if (msg[BGP_MARKER_LEN + 2] != BGP_MSG_UPDATE) {
+	    msg += msg_len;
+	    continue;
+	}
+
+	p = msg + BGP_HEADER_LEN;
+	withdrawn_len = get_be16(p);
+	p += 2 + withdrawn_len;
+	if (p + 2 > msg + msg_len) {
+	    bench->error = true;
+	    return;
+	}
+	attr_len = get_be16(p);
+	p += 2;
+	if (p + attr_len > msg + msg_len) {
+	    bench->error = true;
+	    return;
+	}
+
+	count = bench_decode_pa(bench, p, attr_len, bench->addpath);
+	p += attr_len;
+	count += bench_decode_nlri(bench, p, msg + msg_len - p, bench->addpath);
+	bench->routes += count;
+	msg += msg_len;
+    }
+}
+
+static double
+bench_elapsed (struct timespec *start, struct timespec *stop)
+{
+    return (stop->tv_sec - start->tv_sec) + (stop->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Decode a file a couple of times, report the best run.
+ */
+static int
+bench_file (char *filename, uint runs, bool addpath, bool perf)
+{
+    struct timespec start, stop;
+    perf_sample_t perf_sum, perf_start, perf_stop;
+    struct stat st;
+    bench_t bench;
+    double best, elapsed;
+    bool update;
+    u_char *buf;
+    uint run;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+	fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+	if (fd != -1) {
+	    close(fd);
+	}
+	return -1;
+    }
+    if (!st.st_size) {
+	fprintf(stderr, "Empty file %s\n", filename);
+	close(fd);
+	return -1;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+	fprintf(stderr, "mmap(): %s, error %s (%d)\n", filename, strerror(errno), errno);
+	return -1;
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+    /*
+     * Raw UPDATEs start with the all ones marker.
+     */
+    update = st.st_size >= BGP_MARKER_LEN;
+    for (run = 0; update && run < BGP_MARKER_LEN; run++) {
+	update = (buf[run] == 0xff);
+    }
+
+    best = 0;
+    memset(&perf_sum, 0, sizeof(perf_sum));
+    for (run = 0; run < runs; run++) {
+	memset(&bench, 0, sizeof(bench));
+	bench.addpath = addpath;
+
+	if (perf) {
+	    mrtgen_perf_read(&perf_start);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (update) {
+	    bench_decode_update(&bench, buf, st.st_size);
+	} else {
+	    bench_decode_mrt(&bench, buf, st.st_size);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	if (perf) {
+	    mrtgen_perf_read(&perf_stop);
+	    mrtgen_perf_add(&perf_sum, &perf_start, &perf_stop);
+	}
+
+	elapsed = bench_elapsed(&start, &stop);
+	if (!run || elapsed < best) {
+	    best = elapsed;
+	}
+    }
+    munmap(buf, st.st_size);
+
+    if (bench.error) {
+	fprintf(stderr, "Decode error in %s after %lu records\n", filename,
+		(unsigned long)bench.records);
+	return -1;
+    }
+    if (!bench.routes || best <= 0) {
+	fprintf(stderr, "No routes in %s\n", filename);
+	return -1;
+    }
+
+    /*
+     * ADD-PATH UPDATEs decoded without -a still parse, the path identifier
+     * reads as a couple of zero length NLRIs. Tables hardly consist of
+     * default routes, hence refuse the inflated route count.
+     */
+    if (update && !addpath && bench.default_routes * 2 > bench.routes) {
+	fprintf(stderr, "Mostly zero length NLRIs in %s, ADD-PATH file without -a ?\n", filename);
+	return -1;
+    }
+
+    printf("%s: %s, %lu bytes, %lu records, %lu routes, %.1f bytes/route\n",
+	   filename, update ? "update" : "mrt", (unsigned long)st.st_size,
+	   (unsigned long)bench.records, (unsigned long)bench.routes,
+	   (double)st.st_size / bench.routes);
+    printf("  decode %.3fs, %.0f routes/sec, %.1f MB/s (best of %u, checksum %016llx)\n",
+	   best, bench.routes / best, st.st_size / best / (1024*1024), runs,
+	   (unsigned long long)bench.sum);
+
+    /*
+     * Counters averaged over all runs.
+     */
+    if (perf) {
+	for (run = 0; run < PERF_COUNTER_MAX; run++) {
+	    perf_sum.value[run] /= runs;
+	}
+	printf("  perf %s\n", mrtgen_perf_format(&perf_sum, bench.routes));
+    }
+
+    return 0;
+}
+
+static struct option long_options[] = {
+    { "addpath",            no_argument,        NULL, 'a' },
+    { "perf",               no_argument,        NULL, 'E' },
+    { "runs",               required_argument,  NULL, 'r' },
+    { "help",               no_argument,        NULL, 'h' },
+    { NULL,                 0,                  NULL,  0 }
+};
+
+static void
+bench_print_usage (void)
+{
+    printf("Usage: mrtgen_bench [OPTIONS] file...\n\n");
+    printf("  -a --addpath       raw UPDATE NLRIs carry ADD-PATH path identifiers,\n");
+    printf("                     required for update files generated with --path-num\n");
+    printf("  -E --perf          hardware performance counters, averaged over the runs\n");
+    printf("  -r --runs <args>   decode runs per file, default %u\n", BENCH_RUNS);
+    printf("  -h --help\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+    bool addpath, perf;
+    uint runs;
+    int opt, idx, res;
+
+    addpath = false;
+    perf = false;
+    runs = BENCH_RUNS;
+    while ((opt = getopt_long(argc, argv, "aEr:h", long_options, &idx)) != -1) {
+	switch (opt) {
+	case 'a':
+	    addpath = true;
+	    break;
+	case 'E':
+	    perf = true;
+	    break;
+	case 'r':
+	    runs = atoi(optarg);
+	    break;
+	case 'h': /* fall through */
+	default:
+	    bench_print_usage();
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if (optind == argc || !runs) {
+	bench_print_usage();
+	exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Without any counters decode uninstrumented.
+     */
+    if (perf && !mrtgen_perf_open()) {
+	fprintf(stderr, "Performance counters unavailable\n");
+	perf = false;
+    }
+
+    res = 0;
+    for (idx = optind; idx < argc; idx++) {
+	if (bench_file(argv[idx], runs, addpath, perf) != 0) {
+	    res = 1;
+	}
+    }
+    if (perf) {
+	mrtgen_perf_close();
+    }
+
+    return res;
+}
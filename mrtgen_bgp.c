@@ -0,0 +1,764 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Raw BGP message encoding.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "mrtgen.h"
+#include "bgp.h"
+
+/*
+ * ADD-PATH NLRIs per UPDATE message.
+ * Keeps even IPv6 NLRIs plus path attributes below BGP_MAX_MSG_LEN.
+ */
+#define BGP_UPDATE_PATHS_MAX 128
+
+/*
+ * Push the BGP message header. The length gets filled in by mrtgen_bgp_msg_end().
+ */
+uint
+mrtgen_bgp_msg_start (ctx_t *ctx, uint type)
+{
+    uint start_idx;
+
+    start_idx = ctx->write_idx;
+
+    push_be_uint(ctx, 8, 0xffffffffffffffffULL); /* marker */
+    push_be_uint(ctx, 8, 0xffffffffffffffffULL);
+    push_be_uint(ctx, 2, 0); /* length */
+    push_be_uint(ctx, 1, type); /* type */
+
+    return start_idx;
+}
+
+void
+mrtgen_bgp_msg_end (ctx_t *ctx, uint start_idx)
+{
+    write_be_uint(ctx->write_buf+start_idx+BGP_MARKER_LEN, 2, ctx->write_idx - start_idx);
+}
+
+/*
+ * Advance to the next group of ADD-PATH paths which fits into one UPDATE.
+ * Start with path_id 0, return false once all paths are done.
+ */
+bool
+mrtgen_bgp_next_paths (ctx_t *ctx)
+{
+    uint num_paths;
+
+    num_paths = ctx->num_paths ? ctx->num_paths : 1;
+    ctx->path_id = ctx->path_id ? ctx->path_id + ctx->path_cnt : 1;
+    if (ctx->path_id > num_paths) {
+	return false;
+    }
+    ctx->path_cnt = num_paths - ctx->path_id + 1;
+    if (ctx->path_cnt > BGP_UPDATE_PATHS_MAX) {
+	ctx->path_cnt = BGP_UPDATE_PATHS_MAX;
+    }
+    return true;
+}
+
+/*
+ * Write a fully framed BGP UPDATE message announcing the current group of paths.
+ */
+void
+mrtgen_write_update_msg (ctx_t *ctx, rib_entry_t *re)
+{
+    uint start_idx, pa_length_idx, path;
+
+    start_idx = mrtgen_bgp_msg_start(ctx, BGP_MSG_UPDATE);
+
+    push_be_uint(ctx, 2, 0); /* withdrawn routes length */
+
+    push_be_uint(ctx, 2, 0); /* path attribute length */
+    pa_length_idx = ctx->write_idx;
+    mrtgen_write_pa(ctx, re);
+    write_be_uint(ctx->write_buf+pa_length_idx-2, 2, ctx->write_idx - pa_length_idx);
+
+    /*
+     * IPv4 unicast NLRI. Everything else is part of MP_REACH_NLRI.
+     */
+    if (re->prefix_afi == AF_INET && re->prefix_safi == SAFI_UNICAST) {
+	for (path = ctx->path_id; path < ctx->path_id + ctx->path_cnt; path++) {
+	    if (ctx->num_paths) {
+		push_be_uint(ctx, 4, path); /* path identifier */
+	    }
+	    mrtgen_push_prefix(ctx, re);
+	}
+    }
+
+    mrtgen_bgp_msg_end(ctx, start_idx);
+}
+
+/*
+ * Write a fully framed BGP UPDATE message withdrawing the current group of paths.
+ * IPv4 unicast uses the withdrawn routes, everything else MP_UNREACH_NLRI.
+ */
+void
+mrtgen_write_withdraw_msg (ctx_t *ctx, rib_entry_t *re)
+{
+    uint start_idx, length_idx, length, path;
+    bool ipv4_unicast;
+
+    ipv4_unicast = re->prefix_afi == AF_INET && re->prefix_safi == SAFI_UNICAST;
+
+    start_idx = mrtgen_bgp_msg_start(ctx, BGP_MSG_UPDATE);
+    push_be_uint(ctx, 2, 0); /* withdrawn routes length */
+    if (!ipv4_unicast) {
+	push_be_uint(ctx, 2, 0); /* path attribute length */
+	push_be_uint(ctx, 1, OPTIONAL | EXTENDED_LENGTH); /* flags */
+	push_be_uint(ctx, 1, MP_UNREACH_NLRI); /* type */
+	push_be_uint(ctx, 2, 0); /* length */
+    }
+    length_idx = ctx->write_idx;
+    if (!ipv4_unicast) {
+	push_be_uint(ctx, 2, mrtgen_get_afi(re->prefix_afi)); /* afi */
+	push_be_uint(ctx, 1, re->prefix_safi); /* safi */
+    }
+
+    for (path = ctx->path_id; path < ctx->path_id + ctx->path_cnt; path++) {
+	if (ctx->num_paths) {
+	    push_be_uint(ctx, 4, path); /* path identifier */
+	}
+	mrtgen_push_prefix(ctx, re);
+    }
+
+    /* withdrawn routes or MP_UNREACH_NLRI length */
+    length = ctx->write_idx - length_idx;
+    write_be_uint(ctx->write_buf+length_idx-2, 2, length);
+    if (ipv4_unicast) {
+	push_be_uint(ctx, 2, 0); /* path attribute length */
+    } else {
+	write_be_uint(ctx->write_buf+length_idx-6, 2, length + 4); /* path attribute length */
+    }
+    mrtgen_bgp_msg_end(ctx, start_idx);
+}
+
+/*
+ * Write fully framed BGP UPDATE messages for a route.
+ * All ADD-PATH paths of a prefix share their path attributes,
+ * hence they get packed into as few UPDATEs as possible.
+ */
+void
+mrtgen_write_update (ctx_t *ctx, rib_entry_t *re)
+{
+    ctx->path_id = 0;
+    while (mrtgen_bgp_next_paths(ctx)) {
+	mrtgen_write_update_msg(ctx, re);
+    }
+}
+
+/*
+ * BGP speaker. Establish a session to a peer and blast the generated routes.
+ */
+#define BGP_PORT        179
+#define BGP_HOLD_TIME   90
+#define BGP_SNDBUF      (1024*1024*16)
+#define BGP_RXBUF       (BGP_MAX_MSG_LEN*4)
+
+static struct {
+    int fd;
+    bool open_received;
+    bool established;
+    bool zerocopy;
+    uint32_t peer_as;
+    uint16_t hold_time; /* negotiated, 0 for no keepalives */
+    bool peer_as4; /* peer advertised 4-byte AS */
+    bool peer_add_path; /* peer receives ADD-PATH for our AFI/SAFI */
+
+    /* receive buffer */
+    u_char rx_buf[BGP_RXBUF];
+    uint rx_idx;
+
+    /* zerocopy sends, issued and completed */
+    uint32_t zc_sent;
+    uint32_t zc_done;
+} bgp;
+
+static volatile sig_atomic_t bgp_stop;
+
+static void
+mrtgen_bgp_signal (int sig)
+{
+    (void)sig;
+    bgp_stop = 1;
+}
+
+/*
+ * Parse the capabilities of the peer's OPEN optional parameters.
+ * return -1 if malformed.
+ */
+static int
+mrtgen_bgp_rx_caps (ctx_t *ctx, u_char *opt, uint opt_len)
+{
+    uint idx, param_len, cap_idx, cap_len, tuple;
+
+    for (idx = 0; idx + 2 <= opt_len; idx += 2 + param_len) {
+	param_len = opt[idx+1];
+	if (idx + 2 + param_len > opt_len) {
+	    return -1;
+	}
+	if (opt[idx] != BGP_OPT_PARAM_CAPABILITY) {
+	    continue;
+	}
+
+	for (cap_idx = idx + 2; cap_idx + 2 <= idx + 2 + param_len; cap_idx += 2 + cap_len) {
+	    cap_len = opt[cap_idx+1];
+	    if (cap_idx + 2 + cap_len > idx + 2 + param_len) {
+		return -1;
+	    }
+	    switch (opt[cap_idx]) {
+	    case BGP_CAP_AS4:
+		if (cap_len == 4) {
+		    bgp.peer_as4 = true;
+		    bgp.peer_as = (uint32_t)opt[cap_idx+2] << 24 | opt[cap_idx+3] << 16 |
+			opt[cap_idx+4] << 8 | opt[cap_idx+5];
+		}
+		break;
+	    case BGP_CAP_ADD_PATH:
+		/* afi, safi, send/receive tuples */
+		for (tuple = cap_idx + 2; tuple + 4 <= cap_idx + 2 + cap_len; tuple += 4) {
+		    if ((uint)(opt[tuple] << 8 | opt[tuple+1]) == mrtgen_get_afi(ctx->base.prefix_afi) &&
+			opt[tuple+2] == ctx->base.prefix_safi && (opt[tuple+3] & BGP_ADD_PATH_RECEIVE)) {
+			bgp.peer_add_path = true;
+		    }
+		}
+		break;
+	    default:
+		break;
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ * Process a received BGP message.
+ * return -1 if the session has to go down.
+ */
+static int
+mrtgen_bgp_rx_msg (ctx_t *ctx, u_char *msg, uint len)
+{
+    switch (msg[BGP_MARKER_LEN+2]) {
+    case BGP_MSG_OPEN:
+	if (len < BGP_HEADER_LEN + 10) {
+	    return -1;
+	}
+	bgp.peer_as = msg[BGP_HEADER_LEN+1] << 8 | msg[BGP_HEADER_LEN+2];
+	bgp.hold_time = msg[BGP_HEADER_LEN+3] << 8 | msg[BGP_HEADER_LEN+4];
+	if (BGP_HEADER_LEN + 10 + msg[BGP_HEADER_LEN+9] > len ||
+	    mrtgen_bgp_rx_caps(ctx, msg + BGP_HEADER_LEN + 10, msg[BGP_HEADER_LEN+9]) != 0) {
+	    LOG(ERROR, "Malformed OPEN optional parameters from %s\n", ctx->filename);
+	    return -1;
+	}
+	LOG(NORMAL, "Received OPEN from %s, AS %u, hold-time %u%s%s\n",
+	    ctx->filename, bgp.peer_as, bgp.hold_time,
+	    bgp.peer_as4 ? ", AS4" : "", bgp.peer_add_path ? ", ADD-PATH receive" : "");
+
+	/* the smaller hold time wins, 0 is legal and disables keepalives */
+	if (bgp.hold_time > BGP_HOLD_TIME) {
+	    bgp.hold_time = BGP_HOLD_TIME;
+	}
+	bgp.open_received = true;
+	break;
+    case BGP_MSG_KEEPALIVE:
+	if (!bgp.established) {
+	    LOG(NORMAL, "Session to %s established\n", ctx->filename);
+	}
+	bgp.established = true;
+	break;
+    case BGP_MSG_NOTIFICATION:
+	LOG(ERROR, "Received NOTIFICATION from %s, code %u, subcode %u\n", ctx->filename,
+	    len > BGP_HEADER_LEN ? msg[BGP_HEADER_LEN] : 0,
+	    len > BGP_HEADER_LEN + 1 ? msg[BGP_HEADER_LEN+1] : 0);
+	return -1;
+    default:
+	/* ignore UPDATEs */
+	break;
+    }
+    return 0;
+}
+
+/*
+ * Read from the session and process all complete messages.
+ * return -1 if the session went down.
+ */
+static int
+mrtgen_bgp_rx (ctx_t *ctx, bool block)
+{
+    ssize_t res;
+    uint idx, len;
+
+    res = recv(bgp.fd, bgp.rx_buf + bgp.rx_idx, sizeof(bgp.rx_buf) - bgp.rx_idx,
+	       block ? 0 : MSG_DONTWAIT);
+    if (res == -1) {
+	if (errno == EAGAIN || errno == EINTR) {
+	    return 0;
+	}
+	LOG(ERROR, "recv(): %s, error %s (%d)\n", ctx->filename, strerror(errno), errno);
+	return -1;
+    }
+    if (res == 0) {
+	LOG(ERROR, "Session to %s closed by peer\n", ctx->filename);
+	return -1;
+    }
+    bgp.rx_idx += res;
+
+    idx = 0;
+    while (bgp.rx_idx - idx >= BGP_HEADER_LEN) {
+	len = bgp.rx_buf[idx+BGP_MARKER_LEN] << 8 | bgp.rx_buf[idx+BGP_MARKER_LEN+1];
+	if (len < BGP_HEADER_LEN || len > BGP_MAX_MSG_LEN) {
+	    LOG(ERROR, "Invalid message length %u from %s\n", len, ctx->filename);
+	    return -1;
+	}
+	if (bgp.rx_idx - idx < len) {
+	    break;
+	}
+	if (mrtgen_bgp_rx_msg(ctx, bgp.rx_buf + idx, len) != 0) {
+	    return -1;
+	}
+	idx += len;
+    }
+    memmove(bgp.rx_buf, bgp.rx_buf + idx, bgp.rx_idx - idx);
+    bgp.rx_idx -= idx;
+
+    return 0;
+}
+
+/*
+ * Send the message in the record buffer right away, bypassing the chunk chain.
+ */
+static int
+mrtgen_bgp_tx (ctx_t *ctx)
+{
+    ssize_t res;
+    uint idx;
+
+    idx = 0;
+    while (idx < ctx->write_idx) {
+	res = send(bgp.fd, ctx->write_buf + idx, ctx->write_idx - idx, 0);
+	if (res == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    LOG(ERROR, "send(): %s, error %s (%d)\n", ctx->filename, strerror(errno), errno);
+	    ctx->write_idx = 0;
+	    return -1;
+	}
+	idx += res;
+    }
+    ctx->write_idx = 0;
+    return 0;
+}
+
+/*
+ * Send a NOTIFICATION right away.
+ */
+static void
+mrtgen_bgp_notify (ctx_t *ctx, uint code, uint subcode)
+{
+    uint start_idx;
+
+    start_idx = mrtgen_bgp_msg_start(ctx, BGP_MSG_NOTIFICATION);
+    push_be_uint(ctx, 1, code); /* error code */
+    push_be_uint(ctx, 1, subcode); /* error subcode */
+    mrtgen_bgp_msg_end(ctx, start_idx);
+    mrtgen_bgp_tx(ctx);
+}
+
+static void
+mrtgen_bgp_write_open (ctx_t *ctx)
+{
+    uint start_idx, opt_idx, cap_idx;
+    uint32_t local_as;
+
+    local_as = ctx->base.as_path[0];
+
+    start_idx = mrtgen_bgp_msg_start(ctx, BGP_MSG_OPEN);
+    push_be_uint(ctx, 1, 4); /* version */
+    push_be_uint(ctx, 2, local_as > 0xffff ? AS_TRANS : local_as); /* my AS */
+    push_be_uint(ctx, 2, BGP_HOLD_TIME); /* hold time */
+    mrtgen_push_addr(ctx, ctx->peer_id, 4); /* BGP identifier */
+
+    push_be_uint(ctx, 1, 0); /* optional parameters length */
+    opt_idx = ctx->write_idx;
+
+    push_be_uint(ctx, 1, BGP_OPT_PARAM_CAPABILITY);
+    push_be_uint(ctx, 1, 0); /* parameter length */
+    cap_idx = ctx->write_idx;
+
+    /* Multiprotocol */
+    push_be_uint(ctx, 1, BGP_CAP_MP);
+    push_be_uint(ctx, 1, 4);
+    push_be_uint(ctx, 2, mrtgen_get_afi(ctx->base.prefix_afi)); /* afi */
+    push_be_uint(ctx, 1, 0); /* reserved */
+    push_be_uint(ctx, 1, ctx->base.prefix_safi);
+
+    /* 4-byte AS */
+    if (!ctx->as2) {
+	push_be_uint(ctx, 1, BGP_CAP_AS4);
+	push_be_uint(ctx, 1, 4);
+	push_be_uint(ctx, 4, local_as);
+    }
+
+    /* ADD-PATH */
+    if (ctx->num_paths) {
+	push_be_uint(ctx, 1, BGP_CAP_ADD_PATH);
+	push_be_uint(ctx, 1, 4);
+	push_be_uint(ctx, 2, mrtgen_get_afi(ctx->base.prefix_afi)); /* afi */
+	push_be_uint(ctx, 1, ctx->base.prefix_safi);
+	push_be_uint(ctx, 1, BGP_ADD_PATH_SEND);
+    }
+
+    write_be_uint(ctx->write_buf+cap_idx-1, 1, ctx->write_idx - cap_idx);
+    write_be_uint(ctx->write_buf+opt_idx-1, 1, ctx->write_idx - opt_idx);
+    mrtgen_bgp_msg_end(ctx, start_idx);
+}
+
+static void
+mrtgen_bgp_write_keepalive (ctx_t *ctx)
+{
+    mrtgen_bgp_msg_end(ctx, mrtgen_bgp_msg_start(ctx, BGP_MSG_KEEPALIVE));
+}
+
+/*
+ * End-of-RIB marker. Empty UPDATE for IPv4 unicast, empty MP_UNREACH_NLRI otherwise.
+ */
+static void
+mrtgen_bgp_write_eor (ctx_t *ctx)
+{
+    uint start_idx;
+
+    start_idx = mrtgen_bgp_msg_start(ctx, BGP_MSG_UPDATE);
+    push_be_uint(ctx, 2, 0); /* withdrawn routes length */
+    if (ctx->base.prefix_afi == AF_INET && ctx->base.prefix_safi == SAFI_UNICAST) {
+	push_be_uint(ctx, 2, 0); /* path attribute length */
+    } else {
+	push_be_uint(ctx, 2, 6); /* path attribute length */
+	push_be_uint(ctx, 1, OPTIONAL); /* flags */
+	push_be_uint(ctx, 1, MP_UNREACH_NLRI); /* type */
+	push_be_uint(ctx, 1, 3); /* length */
+	push_be_uint(ctx, 2, mrtgen_get_afi(ctx->base.prefix_afi)); /* afi */
+	push_be_uint(ctx, 1, ctx->base.prefix_safi); /* safi */
+    }
+    mrtgen_bgp_msg_end(ctx, start_idx);
+}
+
+/*
+ * Wait until the kernel released all zerocopy buffers.
+ */
+static int
+mrtgen_bgp_zerocopy_reap (ctx_t *ctx)
+{
+    struct sock_extended_err *serr;
+    struct pollfd pfd;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    char control[128];
+
+    while (bgp.zc_done != bgp.zc_sent) {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(bgp.fd, &msg, MSG_ERRQUEUE) == -1) {
+	    if (errno != EAGAIN && errno != EINTR) {
+		LOG(ERROR, "recvmsg(): %s, error %s (%d)\n", ctx->filename, strerror(errno), errno);
+		return -1;
+	    }
+	    pfd.fd = bgp.fd;
+	    pfd.events = 0; /* POLLERR is always reported */
+	    poll(&pfd, 1, 1000);
+	    continue;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	    serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+	    if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+		continue;
+	    }
+	    bgp.zc_done += serr->ee_data - serr->ee_info + 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Output sink of the speaker. Drain whatever the peer sent,
+ * then send the batch of pre-encoded UPDATEs, zerocopy if available.
+ */
+static int
+mrtgen_bgp_sink (ctx_t *ctx, struct iovec *iov, uint iov_cnt)
+{
+    struct msghdr msg;
+    ssize_t res;
+
+    if (mrtgen_bgp_rx(ctx, false) != 0) {
+	return 1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_cnt;
+
+    while (msg.msg_iovlen) {
+	res = sendmsg(bgp.fd, &msg, bgp.zerocopy ? MSG_ZEROCOPY : 0);
+	if (res == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == ENOBUFS && bgp.zerocopy) {
+
+		/* out of optmem, wait for outstanding completions */
+		if (mrtgen_bgp_zerocopy_reap(ctx) != 0) {
+		    return 1;
+		}
+		continue;
+	    }
+	    LOG(ERROR, "sendmsg(): %s, error %s (%d)\n", ctx->filename, strerror(errno), errno);
+	    return 1;
+	}
+	if (bgp.zerocopy) {
+	    bgp.zc_sent++;
+	}
+
+	/*
+	 * Skip the fully sent chunks, rebase a partial sent one.
+	 */
+	while (msg.msg_iovlen && (size_t)res >= msg.msg_iov->iov_len) {
+	    res -= msg.msg_iov->iov_len;
+	    msg.msg_iov++;
+	    msg.msg_iovlen--;
+	}
+	if (msg.msg_iovlen) {
+	    msg.msg_iov->iov_base = (u_char *)msg.msg_iov->iov_base + res;
+	    msg.msg_iov->iov_len -= res;
+	}
+    }
+
+    /*
+     * The chunks get refilled once we return.
+     */
+    if (bgp.zerocopy) {
+	return mrtgen_bgp_zerocopy_reap(ctx) ? 1 : 0;
+    }
+    return 0;
+}
+
+/*
+ * Connect to the peer. [v6-addr]:port, v4-addr:port or just an address.
+ */
+static int
+mrtgen_bgp_connect (ctx_t *ctx)
+{
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    char addr[INET6_ADDRSTRLEN+8];
+    char *port, *end;
+    int fd, on, sndbuf;
+
+    snprintf(addr, sizeof(addr), "%s", ctx->bgp_peer);
+    port = NULL;
+    if (addr[0] == '[') {
+	end = strchr(addr, ']');
+	if (end) {
+	    *end = 0;
+	    port = end[1] == ':' ? end + 2 : NULL;
+	}
+	memmove(addr, addr + 1, strlen(addr));
+    } else if (strchr(addr, ':') == strrchr(addr, ':')) {
+	port = strchr(addr, ':');
+	if (port) {
+	    *port++ = 0;
+	}
+    }
+
+    memset(&ss, 0, sizeof(ss));
+    sin = (struct sockaddr_in *)&ss;
+    sin6 = (struct sockaddr_in6 *)&ss;
+    if (inet_pton(AF_INET, addr, &sin->sin_addr)) {
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port ? atoi(port) : BGP_PORT);
+    } else if (inet_pton(AF_INET6, addr, &sin6->sin6_addr)) {
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port = htons(port ? atoi(port) : BGP_PORT);
+    } else {
+	LOG(ERROR, "Invalid BGP peer %s\n", ctx->bgp_peer);
+	return -1;
+    }
+
+    fd = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+	LOG(ERROR, "socket(): error %s (%d)\n", strerror(errno), errno);
+	return -1;
+    }
+
+    /*
+     * Large socket buffers. Zerocopy needs to be enabled upfront.
+     */
+    sndbuf = BGP_SNDBUF;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    if (ctx->bgp_zerocopy) {
+	on = 1;
+	bgp.zerocopy = (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
+	if (!bgp.zerocopy) {
+	    LOG(NORMAL, "MSG_ZEROCOPY not supported, error %s (%d)\n", strerror(errno), errno);
+	}
+    }
+
+    if (connect(fd, (struct sockaddr *)&ss, ss.ss_family == AF_INET ?
+		sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)) == -1) {
+	LOG(ERROR, "connect(): %s, error %s (%d)\n", ctx->bgp_peer, strerror(errno), errno);
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Run a BGP session to the configured peer. Blast the entire RIB,
+ * report the achieved rate and keep the session up until interrupted.
+ * return -1 if the table could not be sent.
+ */
+int
+mrtgen_bgp_speaker (ctx_t *ctx)
+{
+    struct timespec start, stop;
+    struct pollfd pfd;
+    time_t last_keepalive;
+    uint64_t updates;
+    double duration;
+    uint num_paths;
+    int res;
+
+    res = -1;
+    memset(&bgp, 0, sizeof(bgp));
+    bgp.fd = mrtgen_bgp_connect(ctx);
+    if (bgp.fd == -1) {
+	return -1;
+    }
+    ctx->sockfd = bgp.fd;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, mrtgen_bgp_signal);
+    signal(SIGTERM, mrtgen_bgp_signal);
+
+    /*
+     * OPEN / KEEPALIVE handshake.
+     */
+    ctx->write_idx = 0;
+    mrtgen_bgp_write_open(ctx);
+    if (mrtgen_bgp_tx(ctx) != 0) {
+	goto close;
+    }
+    while (!bgp.open_received && !bgp_stop) {
+	if (mrtgen_bgp_rx(ctx, true) != 0) {
+	    goto close;
+	}
+    }
+    if (!bgp.open_received) {
+	goto close;
+    }
+
+    /*
+     * Check the peer's OPEN. ADD-PATH is what the table consists of,
+     * 2-byte AS peers get AS_TRANS plus AS4_PATH.
+     */
+    if (bgp.hold_time == 1 || bgp.hold_time == 2) {
+	LOG(ERROR, "Unacceptable hold-time %u from %s\n", bgp.hold_time, ctx->filename);
+	mrtgen_bgp_notify(ctx, BGP_NOTIFY_OPEN_ERROR, BGP_OPEN_BAD_HOLD_TIME);
+	goto close;
+    }
+    if (ctx->num_paths && !bgp.peer_add_path) {
+	LOG(ERROR, "Peer %s does not receive ADD-PATH, required for %u paths per prefix\n",
+	    ctx->filename, ctx->num_paths);
+	mrtgen_bgp_notify(ctx, BGP_NOTIFY_OPEN_ERROR, BGP_OPEN_UNSUPPORTED_CAP);
+	goto close;
+    }
+    if (!ctx->as2 && !bgp.peer_as4) {
+	LOG(NORMAL, "Peer %s has no 4-byte AS support, sending 2-byte AS_PATHs\n", ctx->filename);
+	ctx->as2 = true;
+    }
+    mrtgen_bgp_write_keepalive(ctx);
+    if (mrtgen_bgp_tx(ctx) != 0) {
+	goto close;
+    }
+    while (!bgp.established && !bgp_stop) {
+	if (mrtgen_bgp_rx(ctx, true) != 0) {
+	    goto close;
+	}
+    }
+    if (!bgp.established) {
+	goto close;
+    }
+
+    /*
+     * Blast the pre-encoded UPDATEs, batched by the chunk chain.
+     */
+    ctx->sink = mrtgen_bgp_sink;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ctx->delta_from) {
+	if (mrtgen_delta_write_rib(ctx) != 0) {
+	    goto close;
+	}
+    } else {
+	mrtgen_write_rib(ctx);
+    }
+    mrtgen_bgp_write_eor(ctx);
+    mrtgen_commit_record(ctx);
+    res = mrtgen_fflush(ctx);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (res != 0) {
+	goto close;
+    }
+
+    num_paths = ctx->num_paths ? ctx->num_paths : 1;
+    updates = (uint64_t)ctx->write_count *
+	((num_paths + BGP_UPDATE_PATHS_MAX - 1) / BGP_UPDATE_PATHS_MAX);
+    duration = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    LOG(NORMAL, "Sent %lu updates, %lu bytes in %.3fs, %.0f updates/sec\n",
+	(unsigned long)updates, (unsigned long)ctx->write_bytes, duration,
+	duration > 0 ? updates / duration : 0);
+
+    /*
+     * Keep the session up.
+     */
+    LOG(NORMAL, "Holding session to %s, hold-time %u, interrupt to close\n",
+	ctx->filename, bgp.hold_time);
+    last_keepalive = time(NULL);
+    while (!bgp_stop) {
+	pfd.fd = bgp.fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) > 0 && mrtgen_bgp_rx(ctx, false) != 0) {
+	    goto close;
+	}
+	if (bgp.hold_time && time(NULL) - last_keepalive >= bgp.hold_time / 3) {
+	    mrtgen_bgp_write_keepalive(ctx);
+	    if (mrtgen_bgp_tx(ctx) != 0) {
+		goto close;
+	    }
+	    last_keepalive = time(NULL);
+	}
+    }
+
+    /*
+     * Cease.
+     */
+    mrtgen_bgp_notify(ctx, BGP_NOTIFY_CEASE, BGP_CEASE_ADMIN_SHUTDOWN);
+
+ close:
+    close(bgp.fd);
+    ctx->sockfd = -1;
+    ctx->sink = NULL;
+    return res;
+}
@@ -0,0 +1,266 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Content addressed on-disk cache of generated MRT files.
+ *
+ * Cache files are named by a hash of all parameters which shape the output,
+ * plus the number of generated prefixes. RIB entries are a deterministic
+ * function of their sequence, hence a cached file with fewer prefixes
+ * is a byte prefix of the requested one and gets extended in place.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "mrtgen.h"
+
+/*
+ * Bump whenever the encoding of the MRT file changes.
+ */
+#define MRTGEN_CACHE_VERSION 3
+
+static uint64_t
+mrtgen_cache_hash (uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *ptr;
+
+    /* FNV-1a */
+    for (ptr = data; len; len--, ptr++) {
+	hash ^= *ptr;
+	hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define CACHE_HASH(hash_, field_) mrtgen_cache_hash(hash_, &(field_), sizeof(field_))
+
+/*
+ * Hash all parameters which shape the output, except the number of prefixes.
+ * The timestamp only counts if fixed, otherwise cached files keep theirs.
+ */
+uint64_t
+mrtgen_cache_key (ctx_t *ctx)
+{
+    rib_entry_t *re;
+    uint64_t hash;
+    uint version;
+
+    hash = 0xcbf29ce484222325ULL;
+    version = MRTGEN_CACHE_VERSION;
+    hash = CACHE_HASH(hash, version);
+
+    re = &ctx->base;
+    hash = CACHE_HASH(hash, re->as_path);
+    hash = CACHE_HASH(hash, re->origin);
+    hash = CACHE_HASH(hash, re->prefix_afi);
+    hash = CACHE_HASH(hash, re->prefix_safi);
+    hash = CACHE_HASH(hash, re->prefix_len);
+    hash = CACHE_HASH(hash, re->prefix);
+    hash = CACHE_HASH(hash, re->nexthop_afi);
+    hash = CACHE_HASH(hash, re->nexthop_safi);
+    hash = CACHE_HASH(hash, re->nexthop);
+    hash = CACHE_HASH(hash, re->label);
+    hash = CACHE_HASH(hash, re->localpref);
+
+    hash = CACHE_HASH(hash, ctx->num_nexthops);
+    hash = CACHE_HASH(hash, ctx->num_paths);
+    hash = CACHE_HASH(hash, ctx->pattern);
+    hash = CACHE_HASH(hash, ctx->order);
+    hash = CACHE_HASH(hash, ctx->peer_id);
+    hash = CACHE_HASH(hash, ctx->peer_ip);
+    hash = CACHE_HASH(hash, ctx->peer_as);
+    hash = CACHE_HASH(hash, ctx->format);
+    hash = CACHE_HASH(hash, ctx->as2);
+    if (ctx->now_fixed) {
+	hash = CACHE_HASH(hash, ctx->now);
+    }
+
+    return hash;
+}
+
+/*
+ * Publish a cache file as the output file.
+ * The output must not share its inode with the cache file, as it may get
+ * overwritten later on. Reflink if possible, copy in-kernel otherwise.
+ */
+static int
+mrtgen_cache_publish (ctx_t *ctx, char *cache_path)
+{
+    int in_fd, out_fd;
+    ssize_t res;
+
+    unlink(ctx->filename);
+    in_fd = open(cache_path, O_RDONLY);
+    out_fd = open(ctx->filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (in_fd == -1 || out_fd == -1) {
+	LOG(ERROR, "Could not copy %s to %s: %s\n", cache_path, ctx->filename, strerror(errno));
+	if (in_fd != -1) {
+	    close(in_fd);
+	}
+	if (out_fd != -1) {
+	    close(out_fd);
+	}
+	return -1;
+    }
+
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+	close(in_fd);
+	close(out_fd);
+	return 0;
+    }
+
+    do {
+	res = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+    } while (res > 0);
+    if (res == -1) {
+	LOG(ERROR, "copy_file_range(): %s, error %s (%d)\n", ctx->filename, strerror(errno), errno);
+    }
+
+    close(in_fd);
+    close(out_fd);
+    return res == -1 ? -1 : 0;
+}
+
+/*
+ * Read the MRT timestamp of a cached file.
+ * Extending a file must use the timestamp it got generated with.
+ */
+static int
+mrtgen_cache_read_timestamp (char *path, time_t *now)
+{
+    uint8_t buf[4];
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+	return -1;
+    }
+    if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+	close(fd);
+	return -1;
+    }
+    close(fd);
+
+    *now = (time_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+    return 0;
+}
+
+/*
+ * Lookup the cache.
+ *
+ * return 1 if the output file has been served from the cache.
+ * return 0 if the output needs to be generated. The output file has been opened
+ * and seq_start is set to the first sequence missing in the cache.
+ * return -1 on error.
+ */
+int
+mrtgen_cache_open (ctx_t *ctx)
+{
+    char path[PATH_MAX];
+    struct dirent *dirent;
+    uint64_t key;
+    uint32_t num, best;
+    char *suffix;
+    DIR *dir;
+
+    key = mrtgen_cache_key(ctx);
+    snprintf(ctx->cache_key, sizeof(ctx->cache_key), "%016llx", (unsigned long long)key);
+
+    if (mkdir(ctx->cache_dir, 0755) == -1 && errno != EEXIST) {
+	LOG(ERROR, "Could not create cache directory %s: %s\n", ctx->cache_dir, strerror(errno));
+	return -1;
+    }
+
+    /*
+     * Find an exact match or the largest smaller cached file.
+     * Grouped order depends on the number of prefixes, only exact matches qualify.
+     */
+    dir = opendir(ctx->cache_dir);
+    if (!dir) {
+	LOG(ERROR, "Could not open cache directory %s: %s\n", ctx->cache_dir, strerror(errno));
+	return -1;
+    }
+    best = 0;
+    while ((dirent = readdir(dir))) {
+	if (strncmp(dirent->d_name, ctx->cache_key, 16) || dirent->d_name[16] != '.') {
+	    continue;
+	}
+	num = strtoul(dirent->d_name + 17, &suffix, 10);
+	if (strcmp(suffix, ".mrt") || num > ctx->num_prefixes || num <= best ||
+	    (ctx->order != ORDER_LINEAR && num != ctx->num_prefixes)) {
+	    continue;
+	}
+	best = num;
+    }
+    closedir(dir);
+
+    snprintf(path, sizeof(path), "%s/%s.%u.mrt", ctx->cache_dir, ctx->cache_key, best);
+
+    if (best && best == ctx->num_prefixes) {
+	LOG(NORMAL, "Cache hit %s\n", path);
+	return mrtgen_cache_publish(ctx, path) == 0 ? 1 : -1;
+    }
+
+    /*
+     * Claim the cache file for writing. Extend a smaller one in place.
+     */
+    snprintf(ctx->cache_tmp, sizeof(ctx->cache_tmp), "%s/%s.tmp.%u",
+	     ctx->cache_dir, ctx->cache_key, (uint)getpid());
+
+    if (best && mrtgen_cache_read_timestamp(path, &ctx->now) == 0 &&
+	rename(path, ctx->cache_tmp) == 0) {
+	LOG(NORMAL, "Cache extend %s from %u to %u prefixes\n", path, best, ctx->num_prefixes);
+	ctx->seq_start = best;
+	if (ctx->manifest) {
+	    mrtgen_manifest_read(ctx, ctx->cache_tmp);
+	}
+	ctx->file = fopen(ctx->cache_tmp, "a");
+    } else {
+	LOG(NORMAL, "Cache miss %s/%s\n", ctx->cache_dir, ctx->cache_key);
+	ctx->seq_start = 0;
+	ctx->file = fopen(ctx->cache_tmp, "w");
+    }
+
+    if (!ctx->file) {
+	LOG(ERROR, "Could not open cache file %s: %s\n", ctx->cache_tmp, strerror(errno));
+	return -1;
+    }
+    ctx->sockfd = fileno(ctx->file);
+    ctx->direct = false;
+
+    return 0;
+}
+
+/*
+ * Close the freshly written cache file, move it to its final name
+ * and publish it as the output file.
+ * An incomplete file must never show up under a valid key, it gets dropped.
+ */
+int
+mrtgen_cache_close (ctx_t *ctx)
+{
+    char path[PATH_MAX];
+    int res;
+
+    res = fclose(ctx->file);
+    ctx->file = NULL;
+    if (res != 0 || ctx->write_error) {
+	LOG(ERROR, "Could not write cache file %s%s%s\n", ctx->cache_tmp,
+	    res != 0 ? ": " : "", res != 0 ? strerror(errno) : "");
+	unlink(ctx->cache_tmp);
+	return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s.%u.mrt", ctx->cache_dir, ctx->cache_key, ctx->num_prefixes);
+    if (rename(ctx->cache_tmp, path) == -1) {
+	LOG(ERROR, "Could not rename %s to %s: %s\n", ctx->cache_tmp, path, strerror(errno));
+	unlink(ctx->cache_tmp);
+	return -1;
+    }
+
+    return mrtgen_cache_publish(ctx, path);
+}
@@ -0,0 +1,298 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Delta generation. Given the parameter set of the table a DUT currently has
+ * and the one of the table it shall move to, emit only the difference,
+ * withdrawals of vanished prefixes and announcements of new or changed routes.
+ *
+ * Both tables are walked as two arithmetic generators in prefix order,
+ * a streaming merge compares them, hence no RIB gets materialized.
+ * Output are raw UPDATEs or, in MRT format, BGP4MP messages.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include "mrtgen.h"
+#include "mrt.h"
+#include "bgp.h"
+
+#define DELTA_ARGS_MAX 64
+
+/*
+ * One table, walked route by route.
+ */
+struct delta_stream_ {
+    ctx_t *ctx;
+    uint32_t seq;
+    bool valid;
+    rib_entry_t re;
+};
+
+typedef struct delta_stream_ delta_stream_t;
+
+static void
+mrtgen_delta_next (delta_stream_t *stream)
+{
+    stream->valid = stream->seq < stream->ctx->seq_end;
+    if (stream->valid) {
+	mrtgen_seq_to_entry(stream->ctx, stream->seq++, &stream->re);
+    }
+}
+
+/*
+ * Merge order. Linear tables ascend by prefix, other patterns
+ * only get compared to the same pattern over the same prefixes, hence by sequence.
+ */
+static int
+mrtgen_delta_cmp (ctx_t *ctx, rib_entry_t *a, rib_entry_t *b)
+{
+    __uint128_t addr_a, addr_b;
+    uint len;
+
+    if (ctx->pattern != PATTERN_LINEAR) {
+	return (a->seq > b->seq) - (a->seq < b->seq);
+    }
+
+    if (a->prefix_afi != b->prefix_afi) {
+	return (a->prefix_afi > b->prefix_afi) - (a->prefix_afi < b->prefix_afi);
+    }
+    if (a->prefix_safi != b->prefix_safi) {
+	return (a->prefix_safi > b->prefix_safi) - (a->prefix_safi < b->prefix_safi);
+    }
+    len = a->prefix_afi == AF_INET6 ? 16 : 4;
+    addr_a = mrtgen_load_addr(a->prefix.v6, len);
+    addr_b = mrtgen_load_addr(b->prefix.v6, len);
+    if (addr_a != addr_b) {
+	return (addr_a > addr_b) - (addr_a < addr_b);
+    }
+    return (a->prefix_len > b->prefix_len) - (a->prefix_len < b->prefix_len);
+}
+
+/*
+ * Do two routes for the same prefix share all path attributes ?
+ */
+static bool
+mrtgen_delta_same (rib_entry_t *a, rib_entry_t *b)
+{
+    return a->origin == b->origin &&
+	!memcmp(a->as_path, b->as_path, sizeof(a->as_path)) &&
+	a->nexthop_afi == b->nexthop_afi &&
+	a->nexthop_safi == b->nexthop_safi &&
+	!memcmp(&a->nexthop, &b->nexthop, sizeof(a->nexthop)) &&
+	!memcmp(a->label, b->label, sizeof(a->label)) &&
+	a->localpref == b->localpref;
+}
+
+/*
+ * Parse the parameter set of the table we move away from.
+ */
+static int
+mrtgen_delta_parse (ctx_t *from, char *params)
+{
+    char *argv[DELTA_ARGS_MAX], *line, *tok, *saveptr;
+    int argc, res;
+
+    line = strdup(params);
+    if (!line) {
+	return -1;
+    }
+    argc = 0;
+    argv[argc++] = "mrtgen";
+    for (tok = strtok_r(line, " \t", &saveptr); tok && argc < DELTA_ARGS_MAX - 1;
+	 tok = strtok_r(NULL, " \t", &saveptr)) {
+	argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    mrtgen_init_ctx(from);
+    from->parse_restricted = true;
+    res = mrtgen_parse_args(from, argc, argv);
+
+    /*
+     * String parameters keep pointing into the line, none of them gets used.
+     */
+    free(line);
+    if (res != 0) {
+	return -1;
+    }
+
+    /*
+     * Only table shaping options. The table gets merged in full.
+     */
+    if (from->input || from->delta_from || from->bgp_peer || from->server || from->server_cache ||
+	from->num_threads || from->num_cpus || from->cache_dir || from->manifest || from->direct ||
+	from->sweep_num || from->progress_interval || from->perf ||
+	from->seq_start || from->seq_end < from->num_prefixes) {
+	LOG(ERROR, "Only table shaping options are supported in delta parameter sets\n");
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write the UPDATEs for a route, in MRT format each wrapped into a BGP4MP message.
+ * The peer is the one of the peer table. The local side is the speaker the routes
+ * originate from, its AS leads the AS_PATH and the base nexthop is its address.
+ */
+static void
+mrtgen_delta_write (ctx_t *ctx, rib_entry_t *re, bool withdraw, bool bgp4mp)
+{
+    uint start_idx, length_idx;
+
+    ctx->path_id = 0;
+    while (mrtgen_bgp_next_paths(ctx)) {
+	start_idx = ctx->write_idx;
+	length_idx = 0;
+	if (bgp4mp) {
+	    push_be_uint(ctx, 4, ctx->now); /* timestamp */
+	    push_be_uint(ctx, 2, MRT_BGP4MP); /* type */
+	    push_be_uint(ctx, 2, ctx->num_paths ?
+			 MRT_BGP4MP_MESSAGE_AS4_ADDPATH : MRT_BGP4MP_MESSAGE_AS4); /* subtype */
+	    push_be_uint(ctx, 4, 0); /* length */
+	    length_idx = ctx->write_idx;
+
+	    push_be_uint(ctx, 4, ctx->peer_as); /* peer as */
+	    push_be_uint(ctx, 4, ctx->base.as_path[0]); /* local as */
+	    push_be_uint(ctx, 2, 0); /* interface index */
+	    push_be_uint(ctx, 2, mrtgen_get_afi(ctx->base.prefix_afi)); /* afi */
+	    if (ctx->base.prefix_afi == AF_INET6) {
+		mrtgen_push_addr(ctx, ctx->peer_ip.v6, 16); /* peer ipv6 */
+		if (ctx->base.nexthop_afi == AF_INET6) {
+		    mrtgen_push_addr(ctx, ctx->base.nexthop.v6, 16); /* local ipv6 */
+		} else {
+		    push_be_uint(ctx, 8, 0); /* local ipv6, none configured */
+		    push_be_uint(ctx, 8, 0);
+		}
+	    } else {
+		mrtgen_push_addr(ctx, ctx->peer_ip.v4, 4); /* peer ipv4 */
+		if (ctx->base.nexthop_afi == AF_INET) {
+		    mrtgen_push_addr(ctx, ctx->base.nexthop.v4, 4); /* local ipv4 */
+		} else {
+		    push_be_uint(ctx, 4, 0); /* local ipv4, none configured */
+		}
+	    }
+	}
+
+	if (withdraw) {
+	    mrtgen_write_withdraw_msg(ctx, re);
+	} else {
+	    mrtgen_write_update_msg(ctx, re);
+	}
+
+	if (bgp4mp) {
+	    write_be_uint(ctx->write_buf+start_idx+8, 4, ctx->write_idx - length_idx);
+	}
+    }
+    mrtgen_commit_record(ctx);
+}
+
+/*
+ * Write the difference between the table of the --delta-from parameter set
+ * and the configured one.
+ */
+int
+mrtgen_delta_write_rib (ctx_t *ctx)
+{
+    delta_stream_t from, to;
+    uint32_t withdrawn, announced, changed;
+    bool bgp4mp;
+    int cmp;
+
+    from.ctx = malloc(sizeof(ctx_t));
+    if (!from.ctx) {
+	return -1;
+    }
+    if (mrtgen_delta_parse(from.ctx, ctx->delta_from) != 0) {
+	LOG(ERROR, "Invalid delta parameter set '%s'\n", ctx->delta_from);
+	free(from.ctx);
+	return -1;
+    }
+
+    /*
+     * Non-linear patterns only merge against the same prefixes.
+     * Withdrawals carry the path identifiers of the announcements.
+     */
+    if ((ctx->pattern != PATTERN_LINEAR || from.ctx->pattern != PATTERN_LINEAR) &&
+	(ctx->pattern != from.ctx->pattern ||
+	 ctx->base.prefix_afi != from.ctx->base.prefix_afi ||
+	 ctx->base.prefix_safi != from.ctx->base.prefix_safi ||
+	 ctx->base.prefix_len != from.ctx->base.prefix_len ||
+	 memcmp(&ctx->base.prefix, &from.ctx->base.prefix, sizeof(ctx->base.prefix)))) {
+	LOG(ERROR, "Delta of non-linear patterns requires the same pattern and base prefix\n");
+	free(from.ctx);
+	return -1;
+    }
+    if (ctx->num_paths != from.ctx->num_paths) {
+	LOG(ERROR, "Delta requires the same ADD-PATH paths per prefix\n");
+	free(from.ctx);
+	return -1;
+    }
+
+    /*
+     * Routes get merged in prefix order.
+     */
+    if (ctx->order != ORDER_LINEAR || from.ctx->order != ORDER_LINEAR) {
+	LOG(ERROR, "Delta requires linear order\n");
+	free(from.ctx);
+	return -1;
+    }
+
+    /*
+     * Messages always get encoded as on the wire.
+     */
+    bgp4mp = (ctx->format == FORMAT_MRT);
+    ctx->format = FORMAT_UPDATE;
+
+    LOG(NORMAL, "Delta from '%s', %u prefixes\n", ctx->delta_from, from.ctx->num_prefixes);
+
+    from.seq = from.ctx->seq_start;
+    to.ctx = ctx;
+    to.seq = ctx->seq_start;
+    mrtgen_delta_next(&from);
+    mrtgen_delta_next(&to);
+
+    ctx->write_count = 0;
+    withdrawn = 0;
+    announced = 0;
+    changed = 0;
+    while (from.valid || to.valid) {
+	if (!from.valid) {
+	    cmp = 1;
+	} else if (!to.valid) {
+	    cmp = -1;
+	} else {
+	    cmp = mrtgen_delta_cmp(ctx, &from.re, &to.re);
+	}
+
+	if (cmp < 0) {
+	    mrtgen_delta_write(ctx, &from.re, true, bgp4mp);
+	    withdrawn++;
+	    ctx->write_count++;
+	    mrtgen_delta_next(&from);
+	} else if (cmp > 0) {
+	    mrtgen_delta_write(ctx, &to.re, false, bgp4mp);
+	    announced++;
+	    ctx->write_count++;
+	    mrtgen_delta_next(&to);
+	} else {
+	    if (!mrtgen_delta_same(&from.re, &to.re)) {
+		mrtgen_delta_write(ctx, &to.re, false, bgp4mp);
+		changed++;
+		ctx->write_count++;
+	    }
+	    mrtgen_delta_next(&from);
+	    mrtgen_delta_next(&to);
+	}
+    }
+
+    mrtgen_fflush(ctx);
+    ctx->format = bgp4mp ? FORMAT_MRT : FORMAT_UPDATE;
+    LOG(NORMAL, "Wrote %u withdrawals, %u new and %u changed routes to %s\n",
+	withdrawn, announced, changed, ctx->filename);
+
+    free(from.ctx->write_buf);
+    free(from.ctx);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Rewrite mode. Stream an existing TABLE_DUMP_V2 file, e.g. a collector dump,
+ * and re-emit its unicast prefixes with the attributes of the base entry.
+ * The input gets mapped and walked once, consumed parts are released
+ * such that memory stays constant regardless of the input size.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "mrtgen.h"
+#include "mrt.h"
+#include "bgp.h"
+
+#define INPUT_RELEASE 1024*1024*64 /* release consumed input every 64 MB */
+
+static inline uint32_t
+mrtgen_input_be16 (const u_char *buf)
+{
+    return buf[0] << 8 | buf[1];
+}
+
+static inline uint32_t
+mrtgen_input_be32 (const u_char *buf)
+{
+    return (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+/*
+ * Rewrite a single RIB record into the template.
+ * return the prefix AFI, 0 for records which do not get rewritten, -1 on malformed records.
+ */
+static int
+mrtgen_input_record (const u_char *rec, uint len, rib_entry_t *re)
+{
+    uint subtype, plen, max_len;
+    int afi;
+
+    subtype = mrtgen_input_be16(rec + 6);
+    switch (subtype) {
+    case MRT_RIB_IPV4_UNICAST:
+    case MRT_RIB_IPV4_UNICAST_ADDPATH:
+	afi = AF_INET;
+	max_len = 32;
+	break;
+    case MRT_RIB_IPV6_UNICAST:
+    case MRT_RIB_IPV6_UNICAST_ADDPATH:
+	afi = AF_INET6;
+	max_len = 128;
+	break;
+    default:
+	return 0;
+    }
+
+    /* sequence, prefix length */
+    if (len < 12 + 5) {
+	return -1;
+    }
+    plen = rec[12 + 4];
+    if (plen > max_len || len < 12 + 5 + (plen + 7) / 8) {
+	return -1;
+    }
+
+    re->prefix_len = plen;
+    memset(&re->prefix, 0, sizeof(re->prefix));
+    memcpy(&re->prefix, rec + 12 + 5, (plen + 7) / 8);
+
+    return afi;
+}
+
+/*
+ * Rewrite the input file into the output file.
+ * Prefixes of the base AFI get the base attributes, nexthops rotate
+ * over num_nexthops like in generated tables.
+ */
+int
+mrtgen_input_write_rib (ctx_t *ctx)
+{
+    struct stat st;
+    rib_entry_t re;
+    u_char *buf;
+    size_t idx, released, page;
+    uint rec_len, nexthop_off, nexthop_len;
+    uint32_t skipped;
+    __uint128_t nexthop;
+    int fd, afi, res;
+
+    fd = open(ctx->input, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+	LOG(ERROR, "Could not open input %s: %s\n", ctx->input, strerror(errno));
+	if (fd != -1) {
+	    close(fd);
+	}
+	return -1;
+    }
+    if (!st.st_size) {
+	LOG(ERROR, "Empty input %s\n", ctx->input);
+	close(fd);
+	return -1;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+	LOG(ERROR, "mmap(): %s, error %s (%d)\n", ctx->input, strerror(errno), errno);
+	return -1;
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+    /*
+     * The input peer table gets replaced by ours.
+     */
+    if (ctx->format == FORMAT_MRT) {
+	mrtgen_write_peertable(ctx);
+	mrtgen_commit_record(ctx);
+    }
+
+    memcpy(&re, &ctx->base, sizeof(rib_entry_t));
+    nexthop_len = re.nexthop_afi == AF_INET6 ? 16 : 4;
+    nexthop = mrtgen_load_addr(ctx->base.nexthop.v6, nexthop_len);
+    nexthop_off = 0;
+
+    ctx->write_count = 0;
+    skipped = 0;
+    res = 0;
+    released = 0;
+    page = sysconf(_SC_PAGESIZE);
+
+    for (idx = 0; idx + 12 <= (size_t)st.st_size; idx += 12 + rec_len) {
+	rec_len = mrtgen_input_be32(buf + idx + 8);
+	if (idx + 12 + rec_len > (size_t)st.st_size) {
+	    break;
+	}
+	if (mrtgen_input_be16(buf + idx + 4) != MRT_TABLE_DUMP_V2 ||
+	    mrtgen_input_be16(buf + idx + 6) == MRT_PEER_INDEX_TABLE) {
+	    continue;
+	}
+
+	afi = mrtgen_input_record(buf + idx, 12 + rec_len, &re);
+	if (afi == -1) {
+	    LOG(ERROR, "Malformed record at offset %lu of %s\n", (unsigned long)idx, ctx->input);
+	    res = -1;
+	    break;
+	}
+	if (afi != ctx->base.prefix_afi) {
+	    skipped++;
+	    continue;
+	}
+
+	re.seq = ctx->write_count;
+	mrtgen_store_addr(nexthop + nexthop_off, re.nexthop.v6, nexthop_len);
+	if (++nexthop_off >= ctx->num_nexthops) {
+	    nexthop_off = 0;
+	}
+
+	ctx->write_ribentry(ctx, &re);
+	mrtgen_commit_record(ctx);
+	ctx->write_count++;
+
+	if (log_id[UPDATE].enable) {
+	    mrtgen_log_rib(&re);
+	}
+
+	/*
+	 * Drop the consumed input from the page cache mapping.
+	 */
+	if (idx - released >= INPUT_RELEASE) {
+	    madvise(buf + released, (idx - released) & ~(page - 1), MADV_DONTNEED);
+	    released += (idx - released) & ~(page - 1);
+	}
+    }
+    if (!res && idx != (size_t)st.st_size) {
+	LOG(ERROR, "Truncated record at offset %lu of %s\n", (unsigned long)idx, ctx->input);
+	res = -1;
+    }
+    munmap(buf, st.st_size);
+
+    mrtgen_fflush(ctx);
+    if (res != 0) {
+	return -1;
+    }
+    LOG(NORMAL, "Rewrote %u rib-entries from %s to %s\n", ctx->write_count, ctx->input, ctx->filename);
+    if (skipped) {
+	LOG(NORMAL, "Skipped %u RIB records not matching the base address family\n", skipped);
+    }
+
+    return 0;
+}
@@ -0,0 +1,527 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Buffered output using a chain of fixed size chunks.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "mrtgen.h"
+
+/*
+ * Allocate the output chunk chain.
+ * All chunks are carved out of a single mapping. For O_DIRECT output
+ * chunks are aligned and hugepage backed if hugepages are available.
+ */
+int
+mrtgen_init_chunks (ctx_t *ctx)
+{
+    uint idx;
+
+    if (!ctx->chunk_size || !ctx->chunk_num) {
+	LOG(ERROR, "Invalid chunk configuration, %u chunks of %u bytes\n",
+	    ctx->chunk_num, ctx->chunk_size);
+	return -1;
+    }
+
+    if (ctx->direct && (ctx->chunk_size % DIRECT_ALIGN)) {
+	ctx->chunk_size = (ctx->chunk_size / DIRECT_ALIGN + 1) * DIRECT_ALIGN;
+	LOG(IO, "Align chunk size to %u bytes\n", ctx->chunk_size);
+    }
+
+    ctx->chunk = calloc(ctx->chunk_num, sizeof(chunk_t));
+    if (!ctx->chunk) {
+	LOG(ERROR, "Could not allocate chunk chain\n");
+	return -1;
+    }
+
+    ctx->chunk_mem_size = (size_t)ctx->chunk_size * ctx->chunk_num;
+    ctx->chunk_mem = MAP_FAILED;
+    if (ctx->direct) {
+	ctx->chunk_mem_size = (ctx->chunk_mem_size + HUGEPAGESIZE - 1) & ~((size_t)HUGEPAGESIZE - 1);
+	ctx->chunk_mem = mmap(NULL, ctx->chunk_mem_size, PROT_READ|PROT_WRITE,
+			      MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (ctx->chunk_mem == MAP_FAILED) {
+	    LOG(IO, "No hugepages for chunk chain, using regular pages\n");
+	}
+    }
+    if (ctx->chunk_mem == MAP_FAILED) {
+	ctx->chunk_mem = mmap(NULL, ctx->chunk_mem_size, PROT_READ|PROT_WRITE,
+			      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    }
+    if (ctx->chunk_mem == MAP_FAILED) {
+	LOG(ERROR, "Could not allocate %u chunks of %u bytes\n", ctx->chunk_num, ctx->chunk_size);
+	ctx->chunk_mem = NULL;
+	mrtgen_free_chunks(ctx);
+	return -1;
+    }
+
+    for (idx = 0; idx < ctx->chunk_num; idx++) {
+	ctx->chunk[idx].buf = ctx->chunk_mem + (size_t)idx * ctx->chunk_size;
+    }
+    ctx->chunk_cur = 0;
+
+    LOG(IO, "Allocated %u chunks of %u bytes\n", ctx->chunk_num, ctx->chunk_size);
+
+    return 0;
+}
+
+void
+mrtgen_free_chunks (ctx_t *ctx)
+{
+    if (ctx->chunk_mem) {
+	munmap(ctx->chunk_mem, ctx->chunk_mem_size);
+	ctx->chunk_mem = NULL;
+    }
+
+    free(ctx->chunk);
+    ctx->chunk = NULL;
+}
+
+/*
+ * Open the MRT file.
+ *
+ * In direct mode the file gets opened using O_DIRECT, bypassing the page cache.
+ * The predicted file size gets preallocated upfront, such that
+ * the file does not need to grow its extents while writing.
+ */
+int
+mrtgen_open_output (ctx_t *ctx)
+{
+    off_t size;
+
+    if (!ctx->direct) {
+	ctx->file = fopen(ctx->filename, "w");
+	if (!ctx->file) {
+	    LOG(ERROR, "Could not open MRT file %s\n", ctx->filename);
+	    return -1;
+	}
+	ctx->sockfd = fileno(ctx->file);
+	if (ctx->sockfd == -1) {
+	    LOG(ERROR, "Could not set FD for MRT file %s\n", ctx->filename);
+	    return -1;
+	}
+	return 0;
+    }
+
+    ctx->sockfd = open(ctx->filename, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0644);
+    if (ctx->sockfd == -1 && errno == EINVAL) {
+	LOG(NORMAL, "O_DIRECT not supported for MRT file %s\n", ctx->filename);
+	ctx->sockfd = open(ctx->filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    }
+    if (ctx->sockfd == -1) {
+	LOG(ERROR, "Could not open MRT file %s: %s\n", ctx->filename, strerror(errno));
+	return -1;
+    }
+
+    size = mrtgen_predict_size(ctx);
+    if (fallocate(ctx->sockfd, 0, 0, size) == -1) {
+	LOG(IO, "fallocate(): %lu bytes for %s, error %s (%d)\n",
+	    (unsigned long)size, ctx->filename, strerror(errno), errno);
+    } else {
+	LOG(IO, "Preallocated %lu bytes for %s\n", (unsigned long)size, ctx->filename);
+    }
+
+    return 0;
+}
+
+/*
+ * Close the MRT file.
+ * In direct mode trim the alignment padding and the unused preallocation.
+ */
+void
+mrtgen_close_output (ctx_t *ctx)
+{
+    if (!ctx->direct) {
+	if (ctx->file) {
+	    fclose(ctx->file);
+	    ctx->file = NULL;
+	}
+	return;
+    }
+
+    if (ftruncate(ctx->sockfd, ctx->write_bytes) == -1) {
+	LOG(ERROR, "ftruncate(): %s, error %s (%d)\n", ctx->filename, strerror(errno), errno);
+    }
+    close(ctx->sockfd);
+    ctx->sockfd = -1;
+}
+
+/*
+ * Make sure there is room for another len bytes in the record buffer.
+ * The encoders address the record buffer by index, hence it is safe to move it.
+ */
+void
+mrtgen_reserve_buf (ctx_t *ctx, uint len)
+{
+    u_char *buf;
+    uint size;
+
+    if (ctx->write_idx + len <= ctx->write_size) {
+	return;
+    }
+
+    size = ctx->write_size ? ctx->write_size : RECORDBUFSIZE;
+    while (size < ctx->write_idx + len) {
+	size *= 2;
+    }
+
+    buf = realloc(ctx->write_buf, size);
+    if (!buf) {
+	LOG(ERROR, "Could not grow record buffer to %u bytes\n", size);
+	exit(EXIT_FAILURE);
+    }
+    ctx->write_buf = buf;
+    ctx->write_size = size;
+}
+
+/*
+ * Append the record buffer to the chunk chain.
+ * Flush the chain once all chunks are full.
+ */
+void
+mrtgen_commit_record (ctx_t *ctx)
+{
+    chunk_t *chunk;
+    uint idx, len;
+
+    ctx->write_bytes += ctx->write_idx;
+
+    idx = 0;
+    while (idx < ctx->write_idx) {
+	chunk = &ctx->chunk[ctx->chunk_cur];
+	len = ctx->chunk_size - chunk->idx;
+	if (len > ctx->write_idx - idx) {
+	    len = ctx->write_idx - idx;
+	}
+	memcpy(chunk->buf + chunk->idx, ctx->write_buf + idx, len);
+	chunk->idx += len;
+	idx += len;
+
+	/*
+	 * Chunk full ?
+	 */
+	if (chunk->idx == ctx->chunk_size) {
+	    ctx->chunk_cur++;
+	    if (ctx->chunk_cur == ctx->chunk_num) {
+		mrtgen_fflush(ctx);
+	    }
+	}
+    }
+
+    ctx->write_idx = 0;
+}
+
+/*
+ * Flush the chunk chain.
+ * return 0 if the chain is empty and if the chain has been fully drained.
+ * return 1 if the write failed, which also sticks in write_error.
+ * The chain gets reset in any case, such that subsequent records never overrun it.
+ *
+ * In direct mode the tail chunk gets zero padded to the O_DIRECT alignment,
+ * hence only the final flush may find a partially filled chunk.
+ */
+int
+mrtgen_fflush (ctx_t *ctx)
+{
+    struct iovec iov[IOV_MAX];
+    uint chunk_idx, iov_cnt, iov_idx;
+    ssize_t res;
+    int ret;
+
+    ret = 0;
+    mrtgen_progress_publish(ctx);
+    mrtgen_perf_start(ctx, PERF_PHASE_FLUSH);
+
+    /*
+     * Checksum the records, before any padding.
+     */
+    if (ctx->manifest) {
+	for (chunk_idx = 0; chunk_idx < ctx->chunk_num && ctx->chunk[chunk_idx].idx; chunk_idx++) {
+	    mrtgen_manifest_update(ctx, ctx->chunk[chunk_idx].buf, ctx->chunk[chunk_idx].idx);
+	}
+    }
+
+    /*
+     * Pad the tail chunk.
+     */
+    if (ctx->direct && ctx->chunk_cur < ctx->chunk_num) {
+	chunk_t *chunk;
+	uint pad;
+
+	chunk = &ctx->chunk[ctx->chunk_cur];
+	pad = (DIRECT_ALIGN - (chunk->idx % DIRECT_ALIGN)) % DIRECT_ALIGN;
+	memset(chunk->buf + chunk->idx, 0, pad);
+	chunk->idx += pad;
+    }
+
+    chunk_idx = 0;
+    while (chunk_idx < ctx->chunk_num && ctx->chunk[chunk_idx].idx) {
+
+	/*
+	 * Gather as many chunks as writev() takes.
+	 */
+	iov_cnt = 0;
+	while (iov_cnt < IOV_MAX && chunk_idx + iov_cnt < ctx->chunk_num &&
+	       ctx->chunk[chunk_idx + iov_cnt].idx) {
+	    iov[iov_cnt].iov_base = ctx->chunk[chunk_idx + iov_cnt].buf;
+	    iov[iov_cnt].iov_len = ctx->chunk[chunk_idx + iov_cnt].idx;
+	    iov_cnt++;
+	}
+
+	/*
+	 * Hand off to the output sink.
+	 */
+	if (ctx->sink) {
+	    if (ctx->sink(ctx, iov, iov_cnt) != 0) {
+		ret = 1;
+		goto reset;
+	    }
+	    chunk_idx += iov_cnt;
+	    continue;
+	}
+
+	iov_idx = 0;
+	while (iov_idx < iov_cnt) {
+	    res = writev(ctx->sockfd, &iov[iov_idx], iov_cnt - iov_idx);
+
+	    /*
+	     * Blocked ?
+	     */
+	    if (res == -1) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN: /* fall through */
+		    continue;
+
+		case EPIPE:
+		    break;
+
+		default:
+		    LOG(ERROR, "writev(): error %s (%d)\n", strerror(errno), errno);
+		    ret = 1;
+		    break;
+		}
+		goto reset;
+	    }
+
+	    LOG(IO, "Write %zd bytes from %u chunks to %s\n", res, iov_cnt - iov_idx, ctx->filename);
+
+	    /*
+	     * Skip the fully written chunks, rebase a partial written one.
+	     */
+	    while (iov_idx < iov_cnt && (size_t)res >= iov[iov_idx].iov_len) {
+		res -= iov[iov_idx].iov_len;
+		iov_idx++;
+	    }
+	    if (iov_idx < iov_cnt) {
+		iov[iov_idx].iov_base = (u_char *)iov[iov_idx].iov_base + res;
+		iov[iov_idx].iov_len -= res;
+	    }
+	}
+
+	chunk_idx += iov_cnt;
+    }
+
+ reset:
+    if (ret) {
+	ctx->write_error = true;
+    }
+    for (chunk_idx = 0; chunk_idx < ctx->chunk_num; chunk_idx++) {
+	ctx->chunk[chunk_idx].idx = 0;
+    }
+    ctx->chunk_cur = 0;
+    mrtgen_perf_stop(ctx, PERF_PHASE_FLUSH);
+    return ret;
+}
+
+static int
+mrtgen_sweep_cmp (const void *a, const void *b)
+{
+    const sweep_t *sa = a, *sb = b;
+
+    return (sa->num_prefixes > sb->num_prefixes) - (sa->num_prefixes < sb->num_prefixes);
+}
+
+/*
+ * Parse a comma separated list of table sizes.
+ */
+int
+mrtgen_parse_sweep (ctx_t *ctx, char *arg)
+{
+    char *tok, *save;
+    uint idx;
+
+    free(ctx->sweep);
+    ctx->sweep = NULL;
+    ctx->sweep_num = 0;
+
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+	ctx->sweep = realloc(ctx->sweep, (ctx->sweep_num + 1) * sizeof(sweep_t));
+	if (!ctx->sweep) {
+	    return -1;
+	}
+	memset(&ctx->sweep[ctx->sweep_num], 0, sizeof(sweep_t));
+	ctx->sweep[ctx->sweep_num].num_prefixes = strtoul(tok, NULL, 10);
+	if (!ctx->sweep[ctx->sweep_num].num_prefixes) {
+	    return -1;
+	}
+	ctx->sweep_num++;
+    }
+    if (!ctx->sweep_num) {
+	return -1;
+    }
+
+    /*
+     * Ascending, no duplicates.
+     */
+    qsort(ctx->sweep, ctx->sweep_num, sizeof(sweep_t), mrtgen_sweep_cmp);
+    for (idx = 1; idx < ctx->sweep_num; idx++) {
+	if (ctx->sweep[idx].num_prefixes == ctx->sweep[idx-1].num_prefixes) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static void
+mrtgen_sweep_close_file (sweep_t *sweep)
+{
+    LOG(NORMAL, "Closed sweep file %s, %u rib-entries, %llu bytes\n",
+	sweep->filename, sweep->num_prefixes, (unsigned long long)sweep->written);
+    close(sweep->fd);
+    sweep->fd = -1;
+}
+
+/*
+ * Output sink of a sweep. Tee the chunks to all files which are not yet complete,
+ * each one up to its cutoff.
+ */
+static int
+mrtgen_sweep_sink (ctx_t *ctx, struct iovec *src, uint iov_cnt)
+{
+    struct iovec iov[IOV_MAX];
+    uint64_t len, limit;
+    uint idx, iov_idx, cnt;
+    sweep_t *sweep;
+    ssize_t res;
+
+    len = 0;
+    for (iov_idx = 0; iov_idx < iov_cnt; iov_idx++) {
+	len += src[iov_idx].iov_len;
+    }
+
+    for (idx = 0; idx < ctx->sweep_num; idx++) {
+	sweep = &ctx->sweep[idx];
+	if (sweep->fd == -1) {
+	    continue;
+	}
+
+	/*
+	 * Trim the batch to the cutoff, if known by now.
+	 */
+	limit = len;
+	if (sweep->cutoff && sweep->cutoff - sweep->written < limit) {
+	    limit = sweep->cutoff - sweep->written;
+	}
+	cnt = 0;
+	while (limit && cnt < iov_cnt) {
+	    iov[cnt] = src[cnt];
+	    if (iov[cnt].iov_len > limit) {
+		iov[cnt].iov_len = limit;
+	    }
+	    limit -= iov[cnt].iov_len;
+	    cnt++;
+	}
+
+	iov_idx = 0;
+	while (iov_idx < cnt) {
+	    res = writev(sweep->fd, &iov[iov_idx], cnt - iov_idx);
+	    if (res == -1) {
+		if (errno == EINTR) {
+		    continue;
+		}
+		LOG(ERROR, "writev(): %s, error %s (%d)\n", sweep->filename, strerror(errno), errno);
+		return 1;
+	    }
+	    sweep->written += res;
+
+	    while (iov_idx < cnt && (size_t)res >= iov[iov_idx].iov_len) {
+		res -= iov[iov_idx].iov_len;
+		iov_idx++;
+	    }
+	    if (iov_idx < cnt) {
+		iov[iov_idx].iov_base = (u_char *)iov[iov_idx].iov_base + res;
+		iov[iov_idx].iov_len -= res;
+	    }
+	}
+
+	if (sweep->cutoff && sweep->written == sweep->cutoff) {
+	    mrtgen_sweep_close_file(sweep);
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Open one file per table size. <name>.mrt becomes <name>.<size>.mrt
+ * The largest file becomes the output file.
+ */
+int
+mrtgen_open_sweep (ctx_t *ctx)
+{
+    char *ext, buf[PATH_MAX];
+    sweep_t *sweep;
+    uint idx;
+
+    ext = strrchr(ctx->filename, '.');
+    if (!ext || strchr(ext, '/')) {
+	ext = ctx->filename + strlen(ctx->filename);
+    }
+
+    for (idx = 0; idx < ctx->sweep_num; idx++) {
+	sweep = &ctx->sweep[idx];
+	snprintf(buf, sizeof(buf), "%.*s.%u%s", (int)(ext - ctx->filename), ctx->filename,
+		 sweep->num_prefixes, ext);
+	sweep->filename = strdup(buf);
+	sweep->fd = open(sweep->filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (sweep->fd == -1) {
+	    LOG(ERROR, "Could not open MRT file %s: %s\n", sweep->filename, strerror(errno));
+	    return -1;
+	}
+    }
+
+    ctx->filename = ctx->sweep[ctx->sweep_num-1].filename;
+    ctx->sweep_next = 0;
+    ctx->sink = mrtgen_sweep_sink;
+
+    return 0;
+}
+
+void
+mrtgen_close_sweep (ctx_t *ctx)
+{
+    sweep_t *sweep;
+    uint idx;
+
+    for (idx = 0; idx < ctx->sweep_num; idx++) {
+	sweep = &ctx->sweep[idx];
+	if (sweep->fd == -1) {
+	    continue;
+	}
+	if (sweep->cutoff && sweep->written == sweep->cutoff) {
+	    mrtgen_sweep_close_file(sweep);
+	} else {
+	    LOG(ERROR, "Incomplete sweep file %s\n", sweep->filename);
+	    close(sweep->fd);
+	    sweep->fd = -1;
+	}
+    }
+    ctx->sink = NULL;
+}
@@ -0,0 +1,273 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Output manifest. CRC32C checksums get computed inline while
+ * the chunk chain is flushed, one per fixed size block of the output,
+ * such that blocks can be verified in parallel.
+ *
+ * The file digest is the CRC32C over the big-endian block checksums.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "mrtgen.h"
+
+#define CRC32C_POLY 0x82f63b78 /* reflected Castagnoli */
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_update)(uint32_t, const u_char *, size_t);
+
+/*
+ * Software CRC32C, slicing-by-8.
+ */
+static uint32_t
+mrtgen_crc32c_sw (uint32_t crc, const u_char *buf, size_t len)
+{
+    uint64_t word;
+
+    while (len && ((uintptr_t)buf & 7)) {
+	crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	len--;
+    }
+    while (len >= 8) {
+	memcpy(&word, buf, 8);
+	word ^= crc;
+	crc = crc32c_table[7][word & 0xff] ^
+	    crc32c_table[6][(word >> 8) & 0xff] ^
+	    crc32c_table[5][(word >> 16) & 0xff] ^
+	    crc32c_table[4][(word >> 24) & 0xff] ^
+	    crc32c_table[3][(word >> 32) & 0xff] ^
+	    crc32c_table[2][(word >> 40) & 0xff] ^
+	    crc32c_table[1][(word >> 48) & 0xff] ^
+	    crc32c_table[0][word >> 56];
+	buf += 8;
+	len -= 8;
+    }
+    while (len--) {
+	crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * SSE4.2 CRC32C.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+mrtgen_crc32c_hw (uint32_t crc, const u_char *buf, size_t len)
+{
+    uint64_t crc64, word;
+
+    while (len && ((uintptr_t)buf & 7)) {
+	crc = _mm_crc32_u8(crc, *buf++);
+	len--;
+    }
+    crc64 = crc;
+    while (len >= 8) {
+	memcpy(&word, buf, 8);
+	crc64 = _mm_crc32_u64(crc64, word);
+	buf += 8;
+	len -= 8;
+    }
+    crc = crc64;
+    while (len--) {
+	crc = _mm_crc32_u8(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+static void
+mrtgen_crc32c_init (void)
+{
+    uint32_t crc;
+    uint idx, bit, slice;
+
+    for (idx = 0; idx < 256; idx++) {
+	crc = idx;
+	for (bit = 0; bit < 8; bit++) {
+	    crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+	}
+	crc32c_table[0][idx] = crc;
+    }
+    for (idx = 0; idx < 256; idx++) {
+	crc = crc32c_table[0][idx];
+	for (slice = 1; slice < 8; slice++) {
+	    crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+	    crc32c_table[slice][idx] = crc;
+	}
+    }
+
+    crc32c_update = mrtgen_crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+	crc32c_update = mrtgen_crc32c_hw;
+    }
+#endif
+}
+
+static uint32_t
+mrtgen_crc32c (uint32_t crc, const u_char *buf, size_t len)
+{
+    return ~crc32c_update(~crc, buf, len);
+}
+
+/*
+ * Start a fresh manifest.
+ */
+void
+mrtgen_manifest_init (ctx_t *ctx)
+{
+    if (!crc32c_update) {
+	mrtgen_crc32c_init();
+    }
+
+    ctx->block_num = 0;
+    ctx->block_fill = 0;
+    ctx->block_crc_cur = 0;
+}
+
+static int
+mrtgen_manifest_push_block (ctx_t *ctx)
+{
+    uint32_t *block_crc;
+
+    if (ctx->block_num == ctx->block_max) {
+	ctx->block_max = ctx->block_max ? ctx->block_max * 2 : 1024;
+	block_crc = realloc(ctx->block_crc, ctx->block_max * sizeof(uint32_t));
+	if (!block_crc) {
+	    LOG(ERROR, "Could not allocate manifest blocks\n");
+	    return -1;
+	}
+	ctx->block_crc = block_crc;
+    }
+    ctx->block_crc[ctx->block_num++] = ctx->block_crc_cur;
+    ctx->block_crc_cur = 0;
+    ctx->block_fill = 0;
+    return 0;
+}
+
+/*
+ * Checksum output data. Data is split into MANIFEST_BLOCKSIZE blocks.
+ */
+void
+mrtgen_manifest_update (ctx_t *ctx, const u_char *buf, size_t len)
+{
+    size_t part;
+
+    while (len) {
+	part = MANIFEST_BLOCKSIZE - ctx->block_fill;
+	if (part > len) {
+	    part = len;
+	}
+	ctx->block_crc_cur = mrtgen_crc32c(ctx->block_crc_cur, buf, part);
+	ctx->block_fill += part;
+	buf += part;
+	len -= part;
+
+	if (ctx->block_fill < MANIFEST_BLOCKSIZE) {
+	    break;
+	}
+
+	/*
+	 * Block complete.
+	 */
+	if (mrtgen_manifest_push_block(ctx) != 0) {
+	    exit(EXIT_FAILURE);
+	}
+    }
+}
+
+/*
+ * Checksum an existing file, e.g. the part of a cached file which gets extended.
+ */
+int
+mrtgen_manifest_read (ctx_t *ctx, char *path)
+{
+    u_char *buf;
+    ssize_t res;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+	LOG(ERROR, "Could not open %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    buf = malloc(MANIFEST_BLOCKSIZE);
+    if (!buf) {
+	close(fd);
+	return -1;
+    }
+    while ((res = read(fd, buf, MANIFEST_BLOCKSIZE)) > 0) {
+	mrtgen_manifest_update(ctx, buf, res);
+    }
+    if (res == -1) {
+	LOG(ERROR, "read(): %s, error %s (%d)\n", path, strerror(errno), errno);
+    }
+    free(buf);
+    close(fd);
+
+    return res == -1 ? -1 : 0;
+}
+
+/*
+ * Write <filename>.manifest
+ */
+void
+mrtgen_manifest_write (ctx_t *ctx)
+{
+    char path[PATH_MAX];
+    uint64_t size;
+    uint32_t digest;
+    u_char be[4];
+    uint idx, num;
+    FILE *file;
+
+    /*
+     * Partial tail block.
+     */
+    size = (uint64_t)ctx->block_num * MANIFEST_BLOCKSIZE + ctx->block_fill;
+    if (ctx->block_fill && mrtgen_manifest_push_block(ctx) != 0) {
+	return;
+    }
+    num = ctx->block_num;
+
+    digest = 0;
+    for (idx = 0; idx < num; idx++) {
+	write_be_uint(be, 4, ctx->block_crc[idx]);
+	digest = mrtgen_crc32c(digest, be, 4);
+    }
+
+    snprintf(path, sizeof(path), "%s.manifest", ctx->filename);
+    file = fopen(path, "w");
+    if (!file) {
+	LOG(ERROR, "Could not open manifest %s: %s\n", path, strerror(errno));
+	return;
+    }
+
+    fprintf(file, "file %s\n", ctx->filename);
+    fprintf(file, "size %llu\n", (unsigned long long)size);
+    fprintf(file, "algorithm crc32c\n");
+    fprintf(file, "block-size %u\n", MANIFEST_BLOCKSIZE);
+    fprintf(file, "digest %08x\n", digest);
+    for (idx = 0; idx < num; idx++) {
+	fprintf(file, "block %u %08x\n", idx, ctx->block_crc[idx]);
+    }
+    fclose(file);
+
+    LOG(NORMAL, "Wrote manifest %s, %u blocks, digest %08x\n", path, num, digest);
+
+    free(ctx->block_crc);
+    ctx->block_crc = NULL;
+    ctx->block_max = 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Hardware performance counters around the generate, encode and flush
+ * phases, such that it shows whether a profile is compute, cache or
+ * syscall bound. Counters which cannot be opened, e.g. in containers,
+ * are left out, everything else keeps working.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "mrtgen.h"
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} perf_events[PERF_COUNTER_MAX] = {
+    [PERF_CYCLES]           = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       "cycles" },
+    [PERF_INSTRUCTIONS]     = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     "instructions" },
+    [PERF_CACHE_MISSES]     = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     "cache-misses" },
+    [PERF_BRANCH_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,    "branch-misses" },
+    [PERF_CONTEXT_SWITCHES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches" },
+};
+
+static int perf_fd[PERF_COUNTER_MAX] = { -1, -1, -1, -1, -1 };
+
+static int
+mrtgen_perf_event_open (uint idx, bool exclude_kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[idx].type;
+    attr.config = perf_events[idx].config;
+    attr.inherit = 1; /* include threads spawned later on, e.g. the pipeline */
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Open the counters for this thread and its future children.
+ * Kernel side counting needs privileges, fall back to user space only.
+ * return the number of available counters.
+ */
+uint
+mrtgen_perf_open (void)
+{
+    uint idx, num;
+
+    num = 0;
+    for (idx = 0; idx < PERF_COUNTER_MAX; idx++) {
+	perf_fd[idx] = mrtgen_perf_event_open(idx, false);
+	if (perf_fd[idx] == -1 && (errno == EACCES || errno == EPERM)) {
+	    perf_fd[idx] = mrtgen_perf_event_open(idx, true);
+	}
+	if (perf_fd[idx] != -1) {
+	    num++;
+	}
+    }
+    return num;
+}
+
+void
+mrtgen_perf_close (void)
+{
+    uint idx;
+
+    for (idx = 0; idx < PERF_COUNTER_MAX; idx++) {
+	if (perf_fd[idx] != -1) {
+	    close(perf_fd[idx]);
+	    perf_fd[idx] = -1;
+	}
+    }
+}
+
+/*
+ * Snapshot all counters. Unavailable ones read as zero.
+ */
+void
+mrtgen_perf_read (perf_sample_t *sample)
+{
+    struct timespec now;
+    uint idx;
+
+    for (idx = 0; idx < PERF_COUNTER_MAX; idx++) {
+	sample->value[idx] = 0;
+	if (perf_fd[idx] != -1 &&
+	    read(perf_fd[idx], &sample->value[idx], sizeof(uint64_t)) != sizeof(uint64_t)) {
+	    sample->value[idx] = 0;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample->nsec = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * sum += stop - start
+ */
+void
+mrtgen_perf_add (perf_sample_t *sum, perf_sample_t *start, perf_sample_t *stop)
+{
+    uint idx;
+
+    for (idx = 0; idx < PERF_COUNTER_MAX; idx++) {
+	sum->value[idx] += stop->value[idx] - start->value[idx];
+    }
+    sum->nsec += stop->nsec - start->nsec;
+}
+
+/*
+ * Format a sample, normalized per route if routes is non-zero.
+ */
+char *
+mrtgen_perf_format (perf_sample_t *sample, uint64_t routes)
+{
+    static char buf[512];
+    uint idx;
+    int len;
+
+    len = 0;
+    for (idx = 0; idx < PERF_COUNTER_MAX; idx++) {
+	if (perf_fd[idx] == -1) {
+	    continue;
+	}
+	len += snprintf(buf+len, sizeof(buf)-len, "%s%s %llu", len ? ", " : "",
+			perf_events[idx].name, (unsigned long long)sample->value[idx]);
+	if (routes && idx != PERF_CONTEXT_SWITCHES) {
+	    len += snprintf(buf+len, sizeof(buf)-len, " (%.1f/route)",
+			    (double)sample->value[idx] / routes);
+	}
+	if (idx == PERF_INSTRUCTIONS && perf_fd[PERF_CYCLES] != -1 && sample->value[PERF_CYCLES]) {
+	    len += snprintf(buf+len, sizeof(buf)-len, ", IPC %.2f",
+			    (double)sample->value[PERF_INSTRUCTIONS] / sample->value[PERF_CYCLES]);
+	}
+    }
+    if (!len) {
+	snprintf(buf, sizeof(buf), "counters unavailable");
+    }
+    return buf;
+}
+
+/*
+ * Phase accounting. Phases may nest, flushes happen while writing.
+ */
+void
+mrtgen_perf_start (ctx_t *ctx, uint phase)
+{
+    if (!ctx->perf) {
+	return;
+    }
+    mrtgen_perf_read(&ctx->perf_mark[phase]);
+}
+
+void
+mrtgen_perf_stop (ctx_t *ctx, uint phase)
+{
+    perf_sample_t now;
+
+    if (!ctx->perf) {
+	return;
+    }
+    mrtgen_perf_read(&now);
+    mrtgen_perf_add(&ctx->perf_phase[phase], &ctx->perf_mark[phase], &now);
+}
@@ -0,0 +1,464 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Staged pipeline. A generator thread computes blocks of RIB entries
+ * from their sequence, encoder threads turn them into records and the
+ * calling thread writes the encoded blocks in sequence order through
+ * the chunk chain. Stages are connected by bounded lock-free SPSC rings.
+ *
+ * Blocks are dealt round robin, block n goes to encoder n % K, hence
+ * the writer restores the order by reading the encoders round robin.
+ * Every ring has a return ring, such that buffers cycle without any allocation.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include "mrtgen.h"
+#include "mrt.h"
+
+#define PIPELINE_BLOCK 1024 /* RIB entries per block */
+#define PIPELINE_DEPTH 4    /* blocks in flight per encoder and direction */
+#define RING_SIZE      8    /* power of two, > PIPELINE_DEPTH */
+
+/*
+ * Single producer, single consumer ring.
+ */
+struct ring_ {
+    void *slot[RING_SIZE];
+    uint32_t head __attribute__((aligned(64))); /* written by the producer */
+    uint32_t tail __attribute__((aligned(64))); /* written by the consumer */
+};
+
+typedef struct ring_ ring_t;
+
+/*
+ * Block of RIB entries, from the generator to an encoder.
+ * count 0 terminates the stream.
+ */
+struct gen_block_ {
+    uint32_t seq;
+    uint count;
+    rib_entry_t re[PIPELINE_BLOCK];
+};
+
+typedef struct gen_block_ gen_block_t;
+
+/*
+ * Block of encoded records, from an encoder to the writer.
+ */
+struct enc_block_ {
+    u_char *buf;
+    uint len;
+    uint size;
+    uint32_t seq; /* first sequence */
+    uint count; /* 0 terminates the stream */
+};
+
+typedef struct enc_block_ enc_block_t;
+
+struct encoder_stage_ {
+    pthread_t thread;
+    ctx_t ctx; /* private copy, owns its record buffer */
+    int cpu;
+
+    ring_t gen_ring; /* generator -> encoder */
+    ring_t gen_free; /* encoder -> generator */
+    ring_t enc_ring; /* encoder -> writer */
+    ring_t enc_free; /* writer -> encoder */
+};
+
+typedef struct encoder_stage_ encoder_stage_t;
+
+static struct {
+    ctx_t *ctx;
+    pthread_t generator;
+    int generator_cpu;
+    uint num_encoders;
+    encoder_stage_t *encoder;
+} pipeline;
+
+static inline void
+mrtgen_ring_wait (uint *spins)
+{
+    if (++*spins < 64) {
+#if defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+	return;
+    }
+    sched_yield();
+}
+
+static void
+mrtgen_ring_push (ring_t *ring, void *item)
+{
+    uint32_t head;
+    uint spins;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    spins = 0;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+	mrtgen_ring_wait(&spins);
+    }
+    ring->slot[head & (RING_SIZE - 1)] = item;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *
+mrtgen_ring_pop (ring_t *ring)
+{
+    uint32_t tail;
+    void *item;
+    uint spins;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    spins = 0;
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+	mrtgen_ring_wait(&spins);
+    }
+    item = ring->slot[tail & (RING_SIZE - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
+
+static void
+mrtgen_pipeline_pin (pthread_t thread, int cpu, const char *stage)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+	return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+	LOG(ERROR, "Could not pin %s to cpu %d\n", stage, cpu);
+	return;
+    }
+    LOG(IO, "Pinned %s to cpu %d\n", stage, cpu);
+}
+
+/*
+ * Generator stage. Deal blocks of RIB entries to the encoders round robin.
+ * Blocks end at sweep cutoffs, such that those get recorded exactly.
+ */
+static void *
+mrtgen_pipeline_generator (void *arg)
+{
+    encoder_stage_t *enc;
+    gen_block_t *block;
+    ctx_t *ctx;
+    uint32_t seq;
+    uint idx, count, sweep_idx, block_idx;
+
+    (void)arg;
+    ctx = pipeline.ctx;
+    sweep_idx = 0;
+    block_idx = 0;
+
+    for (seq = ctx->seq_start; seq < ctx->seq_end; seq += count) {
+	count = ctx->seq_end - seq;
+	if (count > PIPELINE_BLOCK) {
+	    count = PIPELINE_BLOCK;
+	}
+	while (sweep_idx < ctx->sweep_num && ctx->sweep[sweep_idx].num_prefixes <= seq) {
+	    sweep_idx++;
+	}
+	if (sweep_idx < ctx->sweep_num && ctx->sweep[sweep_idx].num_prefixes < seq + count) {
+	    count = ctx->sweep[sweep_idx].num_prefixes - seq;
+	}
+
+	enc = &pipeline.encoder[block_idx++ % pipeline.num_encoders];
+	block = mrtgen_ring_pop(&enc->gen_free);
+	block->seq = seq;
+	block->count = count;
+
+	/*
+	 * The batch encoder works straight from the sequence.
+	 */
+	if (!ctx->write_batch) {
+	    for (idx = 0; idx < count; idx++) {
+		mrtgen_seq_to_entry(ctx, seq + idx, &block->re[idx]);
+	    }
+	}
+	mrtgen_ring_push(&enc->gen_ring, block);
+    }
+
+    /*
+     * End of stream, in round robin order as well.
+     */
+    for (idx = 0; idx < pipeline.num_encoders; idx++) {
+	enc = &pipeline.encoder[block_idx++ % pipeline.num_encoders];
+	block = mrtgen_ring_pop(&enc->gen_free);
+	block->count = 0;
+	mrtgen_ring_push(&enc->gen_ring, block);
+    }
+
+    return NULL;
+}
+
+/*
+ * Encoder stage. Encode a block into the private record buffer,
+ * then swap that buffer into the outgoing block.
+ */
+static void *
+mrtgen_pipeline_encoder (void *arg)
+{
+    encoder_stage_t *enc;
+    gen_block_t *block;
+    enc_block_t *out;
+    ctx_t *ctx;
+    u_char *buf;
+    uint idx, size;
+
+    enc = arg;
+    ctx = &enc->ctx;
+    if (ctx->write_batch) {
+	mrtgen_batch_template(ctx);
+    }
+
+    while (1) {
+	block = mrtgen_ring_pop(&enc->gen_ring);
+	out = mrtgen_ring_pop(&enc->enc_free);
+	out->seq = block->seq;
+	out->count = block->count;
+
+	if (block->count) {
+	    ctx->write_idx = 0;
+	    if (ctx->write_batch) {
+		ctx->write_batch(ctx, block->seq, block->count);
+	    } else {
+		for (idx = 0; idx < block->count; idx++) {
+		    ctx->write_ribentry(ctx, &block->re[idx]);
+		}
+	    }
+
+	    buf = out->buf;
+	    size = out->size;
+	    out->buf = ctx->write_buf;
+	    out->size = ctx->write_size;
+	    out->len = ctx->write_idx;
+	    ctx->write_buf = buf;
+	    ctx->write_size = size;
+	    ctx->write_idx = 0;
+	}
+
+	mrtgen_ring_push(&enc->gen_free, block);
+	mrtgen_ring_push(&enc->enc_ring, out);
+	if (!out->count) {
+	    break;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * Parse a comma separated cpu list. The first cpu is for the generator,
+ * the following ones for the encoders, the last one for the writer.
+ * Missing cpus leave stages unpinned.
+ */
+int
+mrtgen_parse_cpus (ctx_t *ctx, char *arg)
+{
+    char *tok, *save;
+
+    ctx->num_cpus = 0;
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+	if (ctx->num_cpus == PIPELINE_CPUS_MAX) {
+	    return -1;
+	}
+	ctx->cpus[ctx->num_cpus++] = atoi(tok);
+    }
+    return ctx->num_cpus ? 0 : -1;
+}
+
+static int
+mrtgen_pipeline_cpu (ctx_t *ctx, uint stage)
+{
+    return stage < ctx->num_cpus ? ctx->cpus[stage] : -1;
+}
+
+/*
+ * Stop the first num encoders before the generator got started,
+ * by sending them the end of stream directly.
+ */
+static void
+mrtgen_pipeline_stop (uint num)
+{
+    encoder_stage_t *enc;
+    gen_block_t *block;
+    uint idx;
+
+    for (idx = 0; idx < num; idx++) {
+	enc = &pipeline.encoder[idx];
+	block = mrtgen_ring_pop(&enc->gen_free);
+	block->count = 0;
+	mrtgen_ring_push(&enc->gen_ring, block);
+	mrtgen_ring_push(&enc->enc_free, mrtgen_ring_pop(&enc->enc_ring));
+	pthread_join(enc->thread, NULL);
+    }
+}
+
+/*
+ * Free all blocks, which are back in the return rings once no stage runs anymore.
+ */
+static void
+mrtgen_pipeline_free (void)
+{
+    encoder_stage_t *enc;
+    enc_block_t *out;
+    uint idx;
+
+    for (idx = 0; idx < pipeline.num_encoders; idx++) {
+	enc = &pipeline.encoder[idx];
+	while (enc->gen_free.head != enc->gen_free.tail) {
+	    free(mrtgen_ring_pop(&enc->gen_free));
+	}
+	while (enc->enc_free.head != enc->enc_free.tail) {
+	    out = mrtgen_ring_pop(&enc->enc_free);
+	    free(out->buf);
+	    free(out);
+	}
+	free(enc->ctx.write_buf);
+    }
+    free(pipeline.encoder);
+}
+
+/*
+ * Write the entire RIB using the pipeline.
+ * The calling thread becomes the writer stage. If the pipeline cannot
+ * be set up, the RIB gets written sequentially instead.
+ */
+void
+mrtgen_pipeline_write_rib (ctx_t *ctx)
+{
+    encoder_stage_t *enc;
+    gen_block_t *block;
+    enc_block_t *out;
+    uint idx, depth, block_idx, ended;
+    u_char *buf;
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.ctx = ctx;
+    pipeline.num_encoders = ctx->num_threads;
+    pipeline.generator_cpu = mrtgen_pipeline_cpu(ctx, 0);
+
+    pipeline.encoder = aligned_alloc(64, pipeline.num_encoders * sizeof(encoder_stage_t));
+    if (!pipeline.encoder) {
+	LOG(ERROR, "Could not allocate pipeline\n");
+	goto sequential;
+    }
+    memset(pipeline.encoder, 0, pipeline.num_encoders * sizeof(encoder_stage_t));
+
+    /*
+     * Encoders work on private contexts, prime the return rings.
+     */
+    for (idx = 0; idx < pipeline.num_encoders; idx++) {
+	enc = &pipeline.encoder[idx];
+	memcpy(&enc->ctx, ctx, sizeof(ctx_t));
+	enc->ctx.write_buf = NULL;
+	enc->ctx.write_size = 0;
+	enc->ctx.write_idx = 0;
+	enc->ctx.chunk = NULL;
+	enc->cpu = mrtgen_pipeline_cpu(ctx, idx + 1);
+
+	for (depth = 0; depth < PIPELINE_DEPTH; depth++) {
+	    block = malloc(sizeof(gen_block_t));
+	    out = calloc(1, sizeof(enc_block_t));
+	    if (!block || !out) {
+		free(block);
+		free(out);
+		LOG(ERROR, "Could not allocate pipeline blocks\n");
+		mrtgen_pipeline_free();
+		goto sequential;
+	    }
+	    mrtgen_ring_push(&enc->gen_free, block);
+	    mrtgen_ring_push(&enc->enc_free, out);
+	}
+    }
+
+    for (idx = 0; idx < pipeline.num_encoders; idx++) {
+	enc = &pipeline.encoder[idx];
+	if (pthread_create(&enc->thread, NULL, mrtgen_pipeline_encoder, enc) != 0) {
+	    LOG(ERROR, "Could not create encoder thread\n");
+	    mrtgen_pipeline_stop(idx);
+	    mrtgen_pipeline_free();
+	    goto sequential;
+	}
+	mrtgen_pipeline_pin(enc->thread, enc->cpu, "encoder");
+    }
+    if (pthread_create(&pipeline.generator, NULL, mrtgen_pipeline_generator, NULL) != 0) {
+	LOG(ERROR, "Could not create generator thread\n");
+	mrtgen_pipeline_stop(pipeline.num_encoders);
+	mrtgen_pipeline_free();
+	goto sequential;
+    }
+    mrtgen_pipeline_pin(pipeline.generator, pipeline.generator_cpu, "generator");
+
+    /*
+     * First write the peer table.
+     */
+    if (!ctx->seq_start && ctx->format == FORMAT_MRT) {
+	mrtgen_write_peertable(ctx);
+	mrtgen_commit_record(ctx);
+    }
+    mrtgen_pipeline_pin(pthread_self(), mrtgen_pipeline_cpu(ctx, pipeline.num_encoders + 1), "writer");
+
+    /*
+     * Writer stage. Collect the encoded blocks in order,
+     * until every encoder has sent its end of stream.
+     */
+    ctx->write_count = 0;
+    ended = 0;
+    for (block_idx = 0; ended < pipeline.num_encoders; block_idx++) {
+	enc = &pipeline.encoder[block_idx % pipeline.num_encoders];
+	out = mrtgen_ring_pop(&enc->enc_ring);
+	if (!out->count) {
+	    ended++;
+	} else {
+	    buf = ctx->write_buf;
+	    ctx->write_buf = out->buf;
+	    ctx->write_idx = out->len;
+	    mrtgen_commit_record(ctx);
+	    ctx->write_buf = buf;
+	    ctx->write_count += out->count;
+
+	    if (ctx->sweep_next < ctx->sweep_num &&
+		out->seq + out->count == ctx->sweep[ctx->sweep_next].num_prefixes) {
+		ctx->sweep[ctx->sweep_next++].cutoff = ctx->write_bytes;
+	    }
+	}
+	mrtgen_ring_push(&enc->enc_free, out);
+    }
+
+    mrtgen_fflush(ctx);
+    LOG(NORMAL, "Wrote %u rib-entries to %s\n", ctx->write_count, ctx->filename);
+
+    pthread_join(pipeline.generator, NULL);
+    for (idx = 0; idx < pipeline.num_encoders; idx++) {
+	pthread_join(pipeline.encoder[idx].thread, NULL);
+    }
+    mrtgen_pipeline_free();
+    return;
+
+ sequential:
+    LOG(NORMAL, "Pipeline unavailable, writing sequentially\n");
+
+    /*
+     * The pipeline computes entries from their sequence, hence main() did
+     * not generate the RIB. Only the batch encoder does without it.
+     */
+    if (!ctx->write_batch) {
+	mrtgen_generate_rib(ctx);
+    }
+    mrtgen_write_rib(ctx);
+    if (!ctx->write_batch) {
+	mrtgen_delete_rib(ctx);
+    }
+}
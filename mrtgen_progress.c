@@ -0,0 +1,184 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Progress reporting. A side thread samples the counters published
+ * by mrtgen_fflush() and prints rates plus an ETA, optionally into a stats file.
+ * The RIB entry loop itself does not pay anything for it.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <pthread.h>
+#include "mrtgen.h"
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool running;
+    bool stop;
+
+    /* published per flush */
+    uint32_t routes;
+    uint64_t bytes;
+
+    /* configuration */
+    uint interval;
+    char *stats_file;
+    char *filename;
+    uint32_t total;
+} progress = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Publish the counters. Called once per flush of the chunk chain.
+ */
+void
+mrtgen_progress_publish (ctx_t *ctx)
+{
+    __atomic_store_n(&progress.routes, ctx->write_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress.bytes, ctx->write_bytes, __ATOMIC_RELAXED);
+}
+
+static double
+mrtgen_progress_elapsed (struct timespec *start, struct timespec *now)
+{
+    return (now->tv_sec - start->tv_sec) + (now->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Write the stats file. Written to a temporary file and renamed,
+ * such that readers never see a partial one.
+ */
+static void
+mrtgen_progress_write_stats (uint32_t routes, uint64_t bytes, double route_rate,
+			     double byte_rate, double eta)
+{
+    char tmp[PATH_MAX];
+    FILE *file;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", progress.stats_file);
+    file = fopen(tmp, "w");
+    if (!file) {
+	LOG(ERROR, "Could not open stats file %s: %s\n", tmp, strerror(errno));
+	return;
+    }
+    fprintf(file, "file %s\n", progress.filename);
+    fprintf(file, "routes %u\n", routes);
+    fprintf(file, "routes-total %u\n", progress.total);
+    fprintf(file, "bytes %llu\n", (unsigned long long)bytes);
+    fprintf(file, "routes-per-sec %.0f\n", route_rate);
+    fprintf(file, "mbytes-per-sec %.1f\n", byte_rate / (1024*1024));
+    fprintf(file, "eta-sec %.0f\n", eta);
+    fclose(file);
+
+    if (rename(tmp, progress.stats_file) == -1) {
+	LOG(ERROR, "Could not rename %s to %s: %s\n", tmp, progress.stats_file, strerror(errno));
+    }
+}
+
+static void *
+mrtgen_progress_thread (void *arg)
+{
+    struct timespec start, now, last, wakeup;
+    uint32_t routes, last_routes;
+    uint64_t bytes, last_bytes;
+    double elapsed, route_rate, byte_rate, eta;
+
+    (void)arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+    last_routes = 0;
+    last_bytes = 0;
+
+    pthread_mutex_lock(&progress.mutex);
+    while (!progress.stop) {
+	clock_gettime(CLOCK_REALTIME, &wakeup);
+	wakeup.tv_sec += progress.interval;
+	pthread_cond_timedwait(&progress.cond, &progress.mutex, &wakeup);
+
+	routes = __atomic_load_n(&progress.routes, __ATOMIC_RELAXED);
+	bytes = __atomic_load_n(&progress.bytes, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/*
+	 * Rates over the last interval, ETA over the entire run.
+	 */
+	elapsed = mrtgen_progress_elapsed(&last, &now);
+	route_rate = elapsed > 0 ? (routes - last_routes) / elapsed : 0;
+	byte_rate = elapsed > 0 ? (bytes - last_bytes) / elapsed : 0;
+	elapsed = mrtgen_progress_elapsed(&start, &now);
+	eta = routes && routes < progress.total ?
+	    elapsed * (progress.total - routes) / routes : 0;
+
+	if (!progress.stop && !progress.total) {
+	    LOG(NORMAL, "Progress %u rib-entries, %.0f routes/sec, %.1f MB/s\n",
+		routes, route_rate, byte_rate / (1024*1024));
+	} else if (!progress.stop) {
+	    LOG(NORMAL, "Progress %u/%u rib-entries (%.1f%%), %.0f routes/sec, %.1f MB/s, ETA %.0fs\n",
+		routes, progress.total, progress.total ? 100.0 * routes / progress.total : 0,
+		route_rate, byte_rate / (1024*1024), eta);
+	}
+	if (progress.stats_file) {
+	    mrtgen_progress_write_stats(routes, bytes, route_rate, byte_rate, eta);
+	}
+
+	last = now;
+	last_routes = routes;
+	last_bytes = bytes;
+    }
+    pthread_mutex_unlock(&progress.mutex);
+
+    return NULL;
+}
+
+/*
+ * Start the progress reporter for the upcoming mrtgen_write_rib().
+ */
+void
+mrtgen_progress_start (ctx_t *ctx)
+{
+    if (!ctx->progress_interval) {
+	return;
+    }
+
+    progress.interval = ctx->progress_interval;
+    progress.stats_file = ctx->stats_file;
+    progress.filename = ctx->filename;
+    progress.total = ctx->input || ctx->delta_from ? 0 : ctx->seq_end - ctx->seq_start; /* open ended */
+    progress.routes = 0;
+    progress.bytes = 0;
+    progress.stop = false;
+
+    if (pthread_create(&progress.thread, NULL, mrtgen_progress_thread, NULL) != 0) {
+	LOG(ERROR, "Could not start progress reporter\n");
+	return;
+    }
+    progress.running = true;
+}
+
+/*
+ * Stop the progress reporter. The stats file gets a final update.
+ */
+void
+mrtgen_progress_stop (ctx_t *ctx)
+{
+    if (!progress.running) {
+	return;
+    }
+
+    mrtgen_progress_publish(ctx);
+
+    pthread_mutex_lock(&progress.mutex);
+    progress.stop = true;
+    pthread_cond_signal(&progress.cond);
+    pthread_mutex_unlock(&progress.mutex);
+
+    pthread_join(progress.thread, NULL);
+    progress.running = false;
+}
@@ -10,12 +10,6 @@
 #include "mrt.h"
 #include "bgp.h"
 
-/*
- * Prototypes.
- */
-void push_be_uint(ctx_t *ctx, uint length, unsigned long long value);
-
-
 __uint128_t
 mrtgen_load_addr (uint8_t *buf, uint len)
 {
@@ -54,6 +48,7 @@ mrtgen_copy_addr (uint8_t *dst, uint8_t *src, uint len)
 void
 mrtgen_push_addr (ctx_t *ctx, uint8_t *src, uint len)
 {
+    mrtgen_reserve_buf(ctx, len);
     mrtgen_copy_addr(ctx->write_buf+ctx->write_idx, src, len);
     ctx->write_idx += len;
 }
@@ -68,6 +63,7 @@ mrtgen_push_prefix (ctx_t *ctx, rib_entry_t *re)
 
     push_be_uint(ctx, 1, re->prefix_len); /* prefix length */
 
+    mrtgen_reserve_buf(ctx, len);
     mrtgen_copy_addr(ctx->write_buf+ctx->write_idx,re->prefix.v4, len);
     ctx->write_idx += len;
 }
@@ -78,6 +74,185 @@ mrtgen_log_rib (rib_entry_t *re)
     LOG(UPDATE, " Prefix %s, Nexthop %s\n", format_prefix(re), format_nexthop(re));
 }
 
+/*
+ * Odd multiplier, a permutation of the sequences modulo any power of two.
+ */
+#define PATTERN_SCATTER_MULT 0x9e3779b97f4a7c15ULL
+
+static __uint128_t
+mrtgen_pattern_block (__uint128_t num, uint shift)
+{
+    return shift < 128 ? num << shift : 0;
+}
+
+/*
+ * Compute the prefix of a RIB entry from its sequence, O(1) for any sequence.
+ * Blocks are of the base prefix length L in an address of W bits.
+ *
+ * nested:  chain c = seq / D covers the c-th block, D = W - L + 1 levels deep
+ *          from the block itself down to its first host route.
+ * scatter: the (seq * odd multiplier) mod 2^L-th block, xor'ed with the base,
+ *          consecutive sequences land all over the address space.
+ * sibling: pair p = seq / 2 are the first two blocks of the p-th L-2 block,
+ *          siblings are never mergeable with a neighbouring pair.
+ */
+static void
+mrtgen_pattern_prefix (ctx_t *ctx, rib_entry_t *re)
+{
+    __uint128_t base, addr;
+    uint width, alen, len, depth;
+
+    switch (re->prefix_afi) {
+    case AF_INET:
+	width = 32;
+	alen = 4;
+	break;
+    case AF_INET6:
+	width = 128;
+	alen = 16;
+	break;
+    default:
+	return;
+    }
+
+    len = ctx->base.prefix_len;
+    base = mrtgen_load_addr(ctx->base.prefix.v4, alen);
+
+    switch (ctx->pattern) {
+    case PATTERN_NESTED:
+	depth = width - len + 1;
+	addr = base + mrtgen_pattern_block(re->seq / depth, width - len);
+	re->prefix_len = len + re->seq % depth;
+	break;
+    case PATTERN_SCATTER:
+	addr = base ^ mrtgen_pattern_block((__uint128_t)re->seq * PATTERN_SCATTER_MULT, width - len);
+	break;
+    case PATTERN_SIBLING:
+	addr = base + mrtgen_pattern_block(re->seq / 2, width - len + 2) +
+	    mrtgen_pattern_block(re->seq % 2, width - len);
+	break;
+    default:
+	return;
+    }
+
+    /* truncates to the address width */
+    mrtgen_store_addr(addr, re->prefix.v4, alen);
+}
+
+static __uint128_t
+mrtgen_prefix_inc (ctx_t *ctx)
+{
+    switch(ctx->base.prefix_afi) {
+    case AF_INET:
+	return (__uint128_t)1 << (32 - ctx->base.prefix_len);
+    case AF_INET6:
+	return (__uint128_t)1 << (128 - ctx->base.prefix_len);
+    default:
+	return 0;
+    }
+}
+
+/*
+ * Map an output position to the sequence of the route written there.
+ *
+ * Grouped order writes the routes of nexthop 0 first, then those of nexthop 1 ...
+ * The route with sequence s uses nexthop s % N, hence group g holds the
+ * sequences g, g + N, g + 2N ... The first M % N groups hold one route more.
+ */
+uint32_t
+mrtgen_order_seq (ctx_t *ctx, uint32_t pos)
+{
+    uint32_t num, q, r, group, idx;
+
+    num = ctx->num_nexthops;
+    if (ctx->order == ORDER_LINEAR || num < 2) {
+	return pos;
+    }
+
+    q = ctx->num_prefixes / num;
+    r = ctx->num_prefixes % num;
+    if (pos < r * (q + 1)) {
+	group = pos / (q + 1);
+	idx = pos % (q + 1);
+    } else {
+	group = r + (pos - r * (q + 1)) / q;
+	idx = (pos - r * (q + 1)) % q;
+    }
+
+    return group + idx * num;
+}
+
+/*
+ * Compute a RIB entry from its output position, without walking the preceding ones.
+ * Yields the same entry as the incremental mrtgen_generate_rib().
+ * Records carry their position as sequence, routes are those of the mapped sequence.
+ */
+void
+mrtgen_seq_to_entry (ctx_t *ctx, uint32_t pos, rib_entry_t *re)
+{
+    __uint128_t addr;
+    uint32_t seq, nexthop_off;
+
+    seq = mrtgen_order_seq(ctx, pos);
+    memcpy(re, &ctx->base, sizeof(rib_entry_t));
+    re->seq = seq;
+
+    if (ctx->pattern != PATTERN_LINEAR) {
+	mrtgen_pattern_prefix(ctx, re);
+    } else {
+	switch (re->prefix_afi) {
+	case AF_INET:
+	    addr = mrtgen_load_addr(re->prefix.v4, 4);
+	    addr += mrtgen_prefix_inc(ctx) * seq;
+	    mrtgen_store_addr(addr, re->prefix.v4, 4);
+	    break;
+	case AF_INET6:
+	    addr = mrtgen_load_addr(re->prefix.v6, 16);
+	    addr += mrtgen_prefix_inc(ctx) * seq;
+	    mrtgen_store_addr(addr, re->prefix.v6, 16);
+	    break;
+	}
+    }
+
+    nexthop_off = ctx->num_nexthops ? seq % ctx->num_nexthops : 0;
+    switch (re->nexthop_afi) {
+    case AF_INET:
+	addr = mrtgen_load_addr(re->nexthop.v4, 4);
+	mrtgen_store_addr(addr + nexthop_off, re->nexthop.v4, 4);
+	break;
+    case AF_INET6:
+	addr = mrtgen_load_addr(re->nexthop.v6, 16);
+	mrtgen_store_addr(addr + nexthop_off, re->nexthop.v6, 16);
+	break;
+    }
+    re->seq = pos;
+}
+
+/*
+ * Generate a RIB in non-linear order. Every entry gets computed from its position.
+ */
+static void
+mrtgen_generate_rib_ordered (ctx_t *ctx)
+{
+    rib_entry_t *re;
+    uint32_t pos;
+
+    for (pos = ctx->seq_start; pos < ctx->seq_end; pos++) {
+	re = malloc(sizeof(rib_entry_t));
+	if (!re) {
+	    LOG(ERROR, "Could not allocate rib-entry\n");
+	    return;
+	}
+	mrtgen_seq_to_entry(ctx, pos, re);
+	CIRCLEQ_INSERT_TAIL(&ctx->rib_qhead, re, rib_qnode);
+
+	/* Log */
+	if (log_id[UPDATE].enable) {
+	    mrtgen_log_rib(re);
+	}
+    }
+}
+
 /*
  * Generate the RIB that we're about to write.
  */
@@ -91,26 +266,64 @@ mrtgen_generate_rib (ctx_t *ctx)
     uint nexthop_count;
     uint seq;
 
+    /*
+     * Batched tables get computed while being written.
+     */
+    if (ctx->write_batch) {
+	return;
+    }
+
     LOG(UPDATE, "Generating RIB updates\n");
 
-    switch(ctx->base.prefix_afi) {
-    case AF_INET:
-	prefix_inc = 1 << (32 - ctx->base.prefix_len);
-	break;
-    case AF_INET6:
-	prefix_inc = 1 << (128 - ctx->base.prefix_len);
-	break;
-    default:
-	prefix_inc = 0;
+    if (ctx->order != ORDER_LINEAR) {
+	mrtgen_generate_rib_ordered(ctx);
+	return;
     }
 
+    prefix_inc = mrtgen_prefix_inc(ctx);
+
     /*
      * Copy the base to the template.
      */
     memcpy(&re_templ, &ctx->base, sizeof(rib_entry_t));
-
     nexthop_count = 1;
-    for (seq = 0; seq < ctx->num_prefixes; seq++) {
+
+    /*
+     * Not starting at the base ? Seek the template to the first sequence.
+     * Prefixes increment linearly, nexthops rotate every num_nexthops routes.
+     */
+    if (ctx->seq_start) {
+	switch (re_templ.prefix_afi) {
+	case AF_INET:
+	    addr = mrtgen_load_addr(re_templ.prefix.v4, 4);
+	    addr += prefix_inc * ctx->seq_start;
+	    mrtgen_store_addr(addr, re_templ.prefix.v4, 4);
+	    break;
+	case AF_INET6:
+	    addr = mrtgen_load_addr(re_templ.prefix.v6, 16);
+	    addr += prefix_inc * ctx->seq_start;
+	    mrtgen_store_addr(addr, re_templ.prefix.v6, 16);
+	    break;
+	}
+
+	if (ctx->num_nexthops) {
+	    nexthop_count += ctx->seq_start % ctx->num_nexthops;
+	    switch (re_templ.nexthop_afi) {
+	    case AF_INET:
+		addr = mrtgen_load_addr(re_templ.nexthop.v4, 4);
+		addr += nexthop_inc * (nexthop_count - 1);
+		mrtgen_store_addr(addr, re_templ.nexthop.v4, 4);
+		break;
+	    case AF_INET6:
+		addr = mrtgen_load_addr(re_templ.nexthop.v6, 16);
+		addr += nexthop_inc * (nexthop_count - 1);
+		mrtgen_store_addr(addr, re_templ.nexthop.v6, 16);
+		break;
+	    }
+	}
+    }
+
+    for (seq = ctx->seq_start; seq < ctx->seq_end; seq++) {
 	re = malloc(sizeof(rib_entry_t));
 	if (!re) {
 	    LOG(ERROR, "Could not allocate rib-entry\n");
@@ -122,6 +335,9 @@ mrtgen_generate_rib (ctx_t *ctx)
 	 */
 	re_templ.seq = seq;
 	memcpy(re, &re_templ, sizeof(rib_entry_t));
+	if (ctx->pattern != PATTERN_LINEAR) {
+	    mrtgen_pattern_prefix(ctx, re);
+	}
 
 	/*
 	 * Increment prefix in template.
@@ -192,66 +408,6 @@ mrtgen_delete_rib (ctx_t *ctx)
     }
 }
 
-/*
- * Flush the write buffer.
- * return 0 if buffer is empty and if the buffer has been fully drained.
- * return 1 if there is still some data lurking in the buffer.
- */
-int
-mrtgen_fflush (ctx_t *ctx)
-{
-    int res;
-
-    if (!ctx->write_idx) {
-        return 0;
-    }
-
-    res = write(ctx->sockfd, ctx->write_buf, ctx->write_idx);
-
-    /*
-     * Blocked ?
-     */
-    if (res == -1) {
-        switch (errno) {
-        case EAGAIN:
-	    break;
-
-	case EPIPE:
-	    return 0;
-
-        default:
-	    LOG(ERROR, "write(): error %s (%d)\n", strerror(errno), errno);
-	    break;
-        }
-	return 1;
-    }
-
-    /*
-     * Full write ?
-     */
-    if (res == (int)ctx->write_idx) {
-	LOG(IO, "Full write %u bytes buffer to %s\n", res, ctx->filename);
-	ctx->write_idx = 0;
-	return 0;
-    }
-
-    /*
-     * Partial write ?
-     */
-    if (res && res < (int)ctx->write_idx) {
-	LOG(IO, "Partial write %u bytes buffer to %s\n", res, ctx->filename);
-
-	/*
-	 * Rebase the buffer.
-	 */
-	memmove(ctx->write_buf, ctx->write_buf+res, ctx->write_idx - res);
-	ctx->write_idx -= res;
-	return 1;
-    }
-
-    return 0;
-}
-
 /*
  * Quick'n dirty big endian writer.
  */
@@ -276,6 +432,11 @@ write_be_uint (u_char *data, uint length, unsigned long long value)
 void
 push_be_uint (ctx_t *ctx, uint length, unsigned long long value)
 {
+    /*
+     * Make room.
+     */
+    mrtgen_reserve_buf(ctx, length);
+
     /*
      * Write the data.
      */
@@ -325,21 +486,30 @@ mrtgen_write_peertable (ctx_t *ctx)
 }
 
 uint
-mrtgen_get_rib_subtype (rib_entry_t *re)
+mrtgen_get_rib_subtype (ctx_t *ctx, rib_entry_t *re)
 {
     uint32_t af;
 
     af = re->prefix_afi << 8 | re->prefix_safi;
     switch (af) {
     case (AF_INET << 8 | SAFI_UNICAST):
-	return MRT_RIB_IPV4_UNICAST;
+	return ctx->num_paths ? MRT_RIB_IPV4_UNICAST_ADDPATH : MRT_RIB_IPV4_UNICAST;
     case (AF_INET6 << 8 | SAFI_UNICAST):
-	return MRT_RIB_IPV6_UNICAST;
+	return ctx->num_paths ? MRT_RIB_IPV6_UNICAST_ADDPATH : MRT_RIB_IPV6_UNICAST;
     default:
-	return MRT_RIB_GENERIC;
+	return ctx->num_paths ? MRT_RIB_GENERIC_ADDPATH : MRT_RIB_GENERIC;
     }
 }
 
+/*
+ * Map a socket address family to its IANA AFI, as used on the wire.
+ */
+uint
+mrtgen_get_afi (uint af)
+{
+    return af == AF_INET6 ? AFI_IPV6 : AFI_IPV4;
+}
+
 uint
 mrtgen_get_nexthop_length (rib_entry_t *re)
 {
@@ -359,12 +529,19 @@ mrtgen_get_nexthop_length (rib_entry_t *re)
 void
 mrtgen_write_mp_reach_nlri (ctx_t *ctx, rib_entry_t *re)
 {
-    uint32_t af;
+    uint32_t af, path;
 
     af = re->prefix_afi << 8 | re->prefix_safi;
     switch (af) {
     case (AF_INET << 8 | SAFI_UNICAST):
     case (AF_INET6 << 8 | SAFI_UNICAST): /* fall through */
+	if (ctx->format == FORMAT_UPDATE && ctx->num_paths) {
+	    for (path = ctx->path_id; path < ctx->path_id + ctx->path_cnt; path++) {
+		push_be_uint(ctx, 4, path); /* path identifier */
+		mrtgen_push_prefix(ctx, re);
+	    }
+	    break;
+	}
 	mrtgen_push_prefix(ctx, re);
 	break;
     default:
@@ -379,6 +556,7 @@ mrtgen_write_pa (ctx_t *ctx, rib_entry_t *re)
     uint8_t pa_flags;
     uint as_path_idx, as_path_length;
     uint idx, seg_len;
+    bool as4_path, as2;
 
     /* Origin */
     pa_flags = TRANSITIVE;
@@ -402,12 +580,35 @@ mrtgen_write_pa (ctx_t *ctx, rib_entry_t *re)
     }
     push_be_uint(ctx, 1, AS_SEQ); /* path segment type */
     push_be_uint(ctx, 1, seg_len); /* seg_len */
+    /* TABLE_DUMP_V2 always carries 4-byte ASNs */
+    as2 = ctx->as2 && ctx->format == FORMAT_UPDATE;
+    as4_path = false;
     for (idx = 0; idx < seg_len; idx++) {
-	push_be_uint(ctx, 4, re->as_path[idx]);
+	if (!as2) {
+	    push_be_uint(ctx, 4, re->as_path[idx]);
+	} else if (re->as_path[idx] > 0xffff) {
+	    push_be_uint(ctx, 2, AS_TRANS);
+	    as4_path = true;
+	} else {
+	    push_be_uint(ctx, 2, re->as_path[idx]);
+	}
     }
     as_path_length = ctx->write_idx - as_path_idx;
     write_be_uint(ctx->write_buf+as_path_idx-1, 1, as_path_length); /* Update AS Path length field */
 
+    /* AS4 PATH, for 2-byte AS speakers */
+    if (as4_path) {
+	pa_flags = OPTIONAL | TRANSITIVE;
+	push_be_uint(ctx, 1, pa_flags); /* flags */
+	push_be_uint(ctx, 1, AS4_PATH); /* type */
+	push_be_uint(ctx, 1, 2 + 4 * seg_len); /* length */
+	push_be_uint(ctx, 1, AS_SEQ); /* path segment type */
+	push_be_uint(ctx, 1, seg_len); /* seg_len */
+	for (idx = 0; idx < seg_len; idx++) {
+	    push_be_uint(ctx, 4, re->as_path[idx]);
+	}
+    }
+
     /* IPv4 nexthop */
     if (re->nexthop_afi == AF_INET) {
 	pa_flags = TRANSITIVE;
@@ -429,15 +630,27 @@ mrtgen_write_pa (ctx_t *ctx, rib_entry_t *re)
     /* MP Reach */
     if (re->prefix_afi != AF_INET || re->prefix_safi != 1) {
 
-	uint mp_reach_idx, mp_reach_length, nh_len;
+	uint mp_reach_idx, mp_reach_length, nh_len, len_size, afi;
 
+	/*
+	 * UPDATE messages may carry many ADD-PATH NLRIs,
+	 * use the proper optional flag and an extended length.
+	 * On the wire the AFI is the IANA one, MRT output keeps its established encoding.
+	 */
 	pa_flags = TRANSITIVE;
+	len_size = 1;
+	afi = re->prefix_afi;
+	if (ctx->format == FORMAT_UPDATE) {
+	    pa_flags = OPTIONAL | EXTENDED_LENGTH;
+	    len_size = 2;
+	    afi = mrtgen_get_afi(re->prefix_afi);
+	}
 	push_be_uint(ctx, 1, pa_flags); /* flags */
 	push_be_uint(ctx, 1, MP_REACH_NLRI); /* type */
-	push_be_uint(ctx, 1, 0); /* length */
+	push_be_uint(ctx, len_size, 0); /* length */
 	mp_reach_idx = ctx->write_idx;
 
-	push_be_uint(ctx, 2, re->prefix_afi);  /* afi */
+	push_be_uint(ctx, 2, afi);  /* afi */
 	push_be_uint(ctx, 1, re->prefix_safi); /* safi */
 
 	/* Nexthop  */
@@ -452,20 +665,27 @@ mrtgen_write_pa (ctx_t *ctx, rib_entry_t *re)
 
 	/* Update MP REACH PA length field */
 	mp_reach_length = ctx->write_idx - mp_reach_idx;
-	write_be_uint(ctx->write_buf+mp_reach_idx-1, 1, mp_reach_length);
+	write_be_uint(ctx->write_buf+mp_reach_idx-len_size, len_size, mp_reach_length);
     }
 }
 
+/*
+ * Write a RIB entry.
+ * For ADD-PATH all paths of a prefix share the path attributes of the first path,
+ * which get encoded once and then copied.
+ */
 void
 mrtgen_write_ribentry (ctx_t *ctx, rib_entry_t *re)
 {
     uint start_idx, length_idx, length, pa_length_idx, pa_length;
+    uint subtype, path;
 
     start_idx = ctx->write_idx;
+    subtype = mrtgen_get_rib_subtype(ctx, re);
 
     push_be_uint(ctx, 4, ctx->now); /* timestamp */
     push_be_uint(ctx, 2, MRT_TABLE_DUMP_V2); /* type */
-    push_be_uint(ctx, 2, mrtgen_get_rib_subtype(re)); /* subtype */
+    push_be_uint(ctx, 2, subtype); /* subtype */
 
     push_be_uint(ctx, 4, 0); /* length */
     length_idx = ctx->write_idx;
@@ -475,17 +695,20 @@ mrtgen_write_ribentry (ctx_t *ctx, rib_entry_t *re)
     /*
      * Write afi/safi for the non ipv4 and non ipv6 RIBs
      */
-    if (mrtgen_get_rib_subtype(re) == MRT_RIB_GENERIC) {
+    if (subtype == MRT_RIB_GENERIC || subtype == MRT_RIB_GENERIC_ADDPATH) {
 	push_be_uint(ctx, 2, re->prefix_afi);  /* afi */
 	push_be_uint(ctx, 1, re->prefix_safi); /* safi */
     }
 
     mrtgen_push_prefix(ctx, re);
 
-    push_be_uint(ctx, 2, 1); /* entry count */
+    push_be_uint(ctx, 2, ctx->num_paths ? ctx->num_paths : 1); /* entry count */
 
     push_be_uint(ctx, 2, 0); /* peer_index */
     push_be_uint(ctx, 4, ctx->now); /* originated timestamp */
+    if (ctx->num_paths) {
+	push_be_uint(ctx, 4, 1); /* path identifier */
+    }
 
     push_be_uint(ctx, 2, 0); /* BGP path attribute length */
     pa_length_idx = ctx->write_idx;
@@ -493,41 +716,351 @@ mrtgen_write_ribentry (ctx_t *ctx, rib_entry_t *re)
     pa_length = ctx->write_idx - pa_length_idx;
     write_be_uint(ctx->write_buf+pa_length_idx-2, 2, pa_length); /* Update PA length field */
 
+    /*
+     * Additional ADD-PATH paths.
+     */
+    for (path = 2; path <= ctx->num_paths; path++) {
+	push_be_uint(ctx, 2, 0); /* peer_index */
+	push_be_uint(ctx, 4, ctx->now); /* originated timestamp */
+	push_be_uint(ctx, 4, path); /* path identifier */
+
+	mrtgen_reserve_buf(ctx, pa_length + 2);
+	memcpy(ctx->write_buf+ctx->write_idx, ctx->write_buf+pa_length_idx-2, pa_length + 2);
+	ctx->write_idx += pa_length + 2;
+    }
+
     length = ctx->write_idx - length_idx;
     write_be_uint(ctx->write_buf+start_idx+8, 4, length); /* Update length field */
 }
 
+/*
+ * Specialized RIB entry encoders.
+ *
+ * mrtgen_encode_ribentry() gets instantiated for each supported
+ * prefix AFI, nexthop AFI, local preference and ADD-PATH profile.
+ * All profile parameters are compile time constants, hence the instances
+ * do not branch per route. Room for the entire record is reserved upfront,
+ * everything else is straight stores into the record buffer.
+ */
+static inline u_char *
+put_be16 (u_char *p, uint16_t value)
+{
+    value = htons(value);
+    memcpy(p, &value, 2);
+    return p + 2;
+}
+
+static inline u_char *
+put_be32 (u_char *p, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(p, &value, 4);
+    return p + 4;
+}
+
+static inline __attribute__((always_inline)) void
+mrtgen_encode_ribentry (ctx_t *ctx, rib_entry_t *re, const int prefix_afi,
+			const int nexthop_afi, const bool localpref, const bool addpath)
+{
+    const uint prefix_size = prefix_afi == AF_INET ? 4 : 16;
+    const uint nexthop_size = nexthop_afi == AF_INET ? 4 : 16;
+    u_char *start, *p, *pa, *mp_reach;
+    uint plen, idx, path, pa_length;
+
+    mrtgen_reserve_buf(ctx, ENCODER_RECORD_MAX * (addpath ? ctx->num_paths : 1));
+    start = p = ctx->write_buf + ctx->write_idx;
+    plen = (re->prefix_len + 7) / 8;
+
+    p = put_be32(p, ctx->now); /* timestamp */
+    p = put_be16(p, MRT_TABLE_DUMP_V2); /* type */
+    if (addpath) {
+	p = put_be16(p, prefix_afi == AF_INET ? MRT_RIB_IPV4_UNICAST_ADDPATH : MRT_RIB_IPV6_UNICAST_ADDPATH);
+    } else {
+	p = put_be16(p, prefix_afi == AF_INET ? MRT_RIB_IPV4_UNICAST : MRT_RIB_IPV6_UNICAST);
+    }
+    p += 4; /* length */
+    p = put_be32(p, re->seq); /* sequence */
+
+    *p++ = re->prefix_len; /* prefix length */
+    memcpy(p, re->prefix.v6, prefix_size); /* overshoot gets overwritten */
+    p += plen;
+
+    p = put_be16(p, addpath ? ctx->num_paths : 1); /* entry count */
+    p = put_be16(p, 0); /* peer_index */
+    p = put_be32(p, ctx->now); /* originated timestamp */
+    if (addpath) {
+	p = put_be32(p, 1); /* path identifier */
+    }
+    p += 2; /* BGP path attribute length */
+    pa = p;
+
+    /* Origin */
+    *p++ = TRANSITIVE;
+    *p++ = ORIGIN;
+    *p++ = 1;
+    *p++ = re->origin;
+
+    /* AS PATH */
+    *p++ = TRANSITIVE;
+    *p++ = AS_PATH;
+    *p++ = 2 + 4 * ctx->as_path_len;
+    *p++ = AS_SEQ;
+    *p++ = ctx->as_path_len;
+    for (idx = 0; idx < ctx->as_path_len; idx++) {
+	p = put_be32(p, re->as_path[idx]);
+    }
+
+    /* IPv4 nexthop */
+    if (nexthop_afi == AF_INET) {
+	*p++ = TRANSITIVE;
+	*p++ = NEXT_HOP;
+	*p++ = 4;
+	memcpy(p, re->nexthop.v4, 4);
+	p += 4;
+    }
+
+    /* Local Pref */
+    if (localpref) {
+	*p++ = TRANSITIVE;
+	*p++ = LOCAL_PREF;
+	*p++ = 4;
+	p = put_be32(p, re->localpref);
+    }
+
+    /* MP Reach */
+    if (prefix_afi == AF_INET6) {
+	*p++ = TRANSITIVE;
+	*p++ = MP_REACH_NLRI;
+	p++; /* length */
+	mp_reach = p;
+	p = put_be16(p, prefix_afi); /* afi */
+	*p++ = SAFI_UNICAST; /* safi */
+	*p++ = nexthop_size;
+	memcpy(p, re->nexthop.v6, nexthop_size);
+	p += nexthop_size;
+	*p++ = 0; /* reserved */
+	*p++ = re->prefix_len;
+	memcpy(p, re->prefix.v6, prefix_size);
+	p += plen;
+	mp_reach[-1] = p - mp_reach;
+    }
+
+    pa_length = p - pa;
+    put_be16(pa - 2, pa_length); /* PA length */
+
+    /* Additional ADD-PATH paths share the path attributes */
+    if (addpath) {
+	for (path = 2; path <= ctx->num_paths; path++) {
+	    p = put_be16(p, 0); /* peer_index */
+	    p = put_be32(p, ctx->now); /* originated timestamp */
+	    p = put_be32(p, path); /* path identifier */
+	    memcpy(p, pa - 2, pa_length + 2);
+	    p += pa_length + 2;
+	}
+    }
+
+    put_be32(start + 8, p - start - 12); /* length */
+    ctx->write_idx += p - start;
+}
+
+#define MRTGEN_ENCODER(name_, prefix_afi_, nexthop_afi_, localpref_, addpath_) \
+    static void                                                         \
+    mrtgen_encode_##name_ (ctx_t *ctx, rib_entry_t *re)                 \
+    {                                                                   \
+	mrtgen_encode_ribentry(ctx, re, prefix_afi_, nexthop_afi_, localpref_, addpath_); \
+    }
+
+MRTGEN_ENCODER(ipv4_nh4, AF_INET, AF_INET, false, false)
+MRTGEN_ENCODER(ipv4_nh4_lp, AF_INET, AF_INET, true, false)
+MRTGEN_ENCODER(ipv4_nh6, AF_INET, AF_INET6, false, false)
+MRTGEN_ENCODER(ipv4_nh6_lp, AF_INET, AF_INET6, true, false)
+MRTGEN_ENCODER(ipv6_nh4, AF_INET6, AF_INET, false, false)
+MRTGEN_ENCODER(ipv6_nh4_lp, AF_INET6, AF_INET, true, false)
+MRTGEN_ENCODER(ipv6_nh6, AF_INET6, AF_INET6, false, false)
+MRTGEN_ENCODER(ipv6_nh6_lp, AF_INET6, AF_INET6, true, false)
+MRTGEN_ENCODER(ipv4_nh4_ap, AF_INET, AF_INET, false, true)
+MRTGEN_ENCODER(ipv4_nh4_lp_ap, AF_INET, AF_INET, true, true)
+MRTGEN_ENCODER(ipv4_nh6_ap, AF_INET, AF_INET6, false, true)
+MRTGEN_ENCODER(ipv4_nh6_lp_ap, AF_INET, AF_INET6, true, true)
+MRTGEN_ENCODER(ipv6_nh4_ap, AF_INET6, AF_INET, false, true)
+MRTGEN_ENCODER(ipv6_nh4_lp_ap, AF_INET6, AF_INET, true, true)
+MRTGEN_ENCODER(ipv6_nh6_ap, AF_INET6, AF_INET6, false, true)
+MRTGEN_ENCODER(ipv6_nh6_lp_ap, AF_INET6, AF_INET6, true, true)
+
+struct encoder_ {
+    uint8_t prefix_afi;
+    uint8_t nexthop_afi;
+    bool localpref;
+    bool addpath;
+    void (*write_ribentry)(ctx_t *, rib_entry_t *);
+    const char *name;
+};
+
+static const struct encoder_ encoders[] = {
+    { AF_INET,  AF_INET,  false, false, mrtgen_encode_ipv4_nh4,       "ipv4-unicast" },
+    { AF_INET,  AF_INET,  true,  false, mrtgen_encode_ipv4_nh4_lp,    "ipv4-unicast, local-pref" },
+    { AF_INET,  AF_INET6, false, false, mrtgen_encode_ipv4_nh6,       "ipv4-unicast, ipv6 nexthop" },
+    { AF_INET,  AF_INET6, true,  false, mrtgen_encode_ipv4_nh6_lp,    "ipv4-unicast, ipv6 nexthop, local-pref" },
+    { AF_INET6, AF_INET,  false, false, mrtgen_encode_ipv6_nh4,       "ipv6-unicast, ipv4 nexthop" },
+    { AF_INET6, AF_INET,  true,  false, mrtgen_encode_ipv6_nh4_lp,    "ipv6-unicast, ipv4 nexthop, local-pref" },
+    { AF_INET6, AF_INET6, false, false, mrtgen_encode_ipv6_nh6,       "ipv6-unicast" },
+    { AF_INET6, AF_INET6, true,  false, mrtgen_encode_ipv6_nh6_lp,    "ipv6-unicast, local-pref" },
+    { AF_INET,  AF_INET,  false, true,  mrtgen_encode_ipv4_nh4_ap,    "ipv4-unicast-addpath" },
+    { AF_INET,  AF_INET,  true,  true,  mrtgen_encode_ipv4_nh4_lp_ap, "ipv4-unicast-addpath, local-pref" },
+    { AF_INET,  AF_INET6, false, true,  mrtgen_encode_ipv4_nh6_ap,    "ipv4-unicast-addpath, ipv6 nexthop" },
+    { AF_INET,  AF_INET6, true,  true,  mrtgen_encode_ipv4_nh6_lp_ap, "ipv4-unicast-addpath, ipv6 nexthop, local-pref" },
+    { AF_INET6, AF_INET,  false, true,  mrtgen_encode_ipv6_nh4_ap,    "ipv6-unicast-addpath, ipv4 nexthop" },
+    { AF_INET6, AF_INET,  true,  true,  mrtgen_encode_ipv6_nh4_lp_ap, "ipv6-unicast-addpath, ipv4 nexthop, local-pref" },
+    { AF_INET6, AF_INET6, false, true,  mrtgen_encode_ipv6_nh6_ap,    "ipv6-unicast-addpath" },
+    { AF_INET6, AF_INET6, true,  true,  mrtgen_encode_ipv6_nh6_lp_ap, "ipv6-unicast-addpath, local-pref" },
+    { 0, 0, false, false, NULL, NULL }
+};
+
+/*
+ * Select the RIB entry encoder matching the base entry profile.
+ * All generated routes share that profile. Anything without
+ * a specialized encoder goes through the generic mrtgen_write_ribentry().
+ */
+void
+mrtgen_select_encoder (ctx_t *ctx)
+{
+    const struct encoder_ *enc;
+    rib_entry_t *re;
+
+    re = &ctx->base;
+    for (ctx->as_path_len = 0; ctx->as_path_len < AS_PATH_MAX; ctx->as_path_len++) {
+	if (!re->as_path[ctx->as_path_len]) {
+	    break;
+	}
+    }
+
+    ctx->write_batch = NULL;
+    if (ctx->format == FORMAT_UPDATE) {
+	ctx->write_ribentry = mrtgen_write_update;
+	LOG(NORMAL, " Encoder BGP update\n");
+	return;
+    }
+
+    ctx->write_ribentry = mrtgen_write_ribentry;
+    if (re->prefix_safi != SAFI_UNICAST || re->nexthop_safi != SAFI_UNICAST) {
+	LOG(NORMAL, " Encoder generic\n");
+	return;
+    }
+
+    for (enc = encoders; enc->write_ribentry; enc++) {
+	if (enc->prefix_afi == re->prefix_afi && enc->nexthop_afi == re->nexthop_afi &&
+	    enc->localpref == (re->localpref != 0) && enc->addpath == (ctx->num_paths != 0)) {
+	    ctx->write_ribentry = enc->write_ribentry;
+	    LOG(NORMAL, " Encoder %s\n", enc->name);
+	    mrtgen_select_batch_encoder(ctx);
+	    return;
+	}
+    }
+    LOG(NORMAL, " Encoder generic\n");
+}
+
+/*
+ * Predict the size of the MRT file.
+ * All RIB entries share the shape of the base entry.
+ * Nested prefixes get as long as host routes, which is an upper bound.
+ */
+off_t
+mrtgen_predict_size (ctx_t *ctx)
+{
+    rib_entry_t re;
+    off_t size;
+
+    ctx->write_idx = 0;
+    if (!ctx->seq_start && ctx->format == FORMAT_MRT) {
+	mrtgen_write_peertable(ctx);
+    }
+    size = ctx->write_idx;
+
+    memcpy(&re, &ctx->base, sizeof(rib_entry_t));
+    if (ctx->pattern == PATTERN_NESTED) {
+	re.prefix_len = re.prefix_afi == AF_INET6 ? 128 : 32;
+    }
+    ctx->write_idx = 0;
+    ctx->write_ribentry(ctx, &re);
+    size += (off_t)ctx->write_idx * (ctx->seq_end - ctx->seq_start);
+
+    ctx->write_idx = 0;
+    return size;
+}
+
+/*
+ * Write RIB entries in batches, straight from their sequence.
+ * Batches end at sweep cutoffs, such that those get recorded exactly.
+ */
+static void
+mrtgen_write_rib_batched (ctx_t *ctx)
+{
+    uint32_t seq, count, cutoff;
+
+    mrtgen_batch_template(ctx);
+
+    for (seq = ctx->seq_start; seq < ctx->seq_end; seq += count) {
+	count = ctx->seq_end - seq;
+	if (count > BATCH_RECORDS) {
+	    count = BATCH_RECORDS;
+	}
+	cutoff = 0;
+	if (ctx->sweep_next < ctx->sweep_num) {
+	    cutoff = ctx->sweep[ctx->sweep_next].num_prefixes;
+	    if (cutoff < seq + count) {
+		count = cutoff - seq;
+	    }
+	}
+
+	ctx->write_batch(ctx, seq, count);
+	mrtgen_commit_record(ctx);
+	ctx->write_count += count;
+
+	if (cutoff == seq + count) {
+	    ctx->sweep[ctx->sweep_next++].cutoff = ctx->write_bytes;
+	}
+    }
+}
+
 /*
  * Write the entire RIB into a MRT file.
- * Use a buffered write for this.
+ * Records get appended to the chunk chain, which flushes itself once full.
  */
 void
 mrtgen_write_rib (ctx_t *ctx)
 {
     rib_entry_t *re;
-    uint count;
 
     /*
      * First write the peer table.
+     * Appending to an existing file already has it, raw UPDATEs have none.
      */
-    mrtgen_write_peertable(ctx);
+    if (!ctx->seq_start && ctx->format == FORMAT_MRT) {
+	mrtgen_write_peertable(ctx);
+	mrtgen_commit_record(ctx);
+    }
 
     /*
      * Next write a set of RIB entries.
      */
-    count = 0;
+    ctx->write_count = 0;
+    if (ctx->write_batch) {
+	mrtgen_write_rib_batched(ctx);
+    }
     CIRCLEQ_FOREACH(re, &ctx->rib_qhead, rib_qnode) {
-	mrtgen_write_ribentry(ctx, re);
-	count++;
+	ctx->write_ribentry(ctx, re);
+	mrtgen_commit_record(ctx);
+	ctx->write_count++;
 
 	/*
-	 * Buffer 90% full ?
+	 * Sweep file complete ? Record its size.
 	 */
-	if ((ctx->write_idx) >= ((WRITEBUFSIZE*9)/10)) {
-	    mrtgen_fflush(ctx);
+	if (ctx->sweep_next < ctx->sweep_num &&
+	    re->seq + 1 == ctx->sweep[ctx->sweep_next].num_prefixes) {
+	    ctx->sweep[ctx->sweep_next++].cutoff = ctx->write_bytes;
 	}
     }
 
     mrtgen_fflush(ctx);
-    LOG(NORMAL, "Wrote %u rib-entries to %s\n", count, ctx->filename);
+    LOG(NORMAL, "Wrote %u rib-entries to %s\n", ctx->write_count, ctx->filename);
 }
@@ -0,0 +1,554 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster mode
+ *
+ * Server mode. Listen on a UNIX or TCP socket, read a parameter set
+ * per connection and stream the generated MRT data back.
+ * Generated streams are cached in memory and shared by all clients
+ * asking for the same parameter set. Rejected parameter sets get
+ * a single "ERROR <reason>" line instead.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "mrtgen.h"
+
+#define SERVER_LINE_MAX  1024
+#define SERVER_ARGS_MAX  64
+#define SERVER_CACHE_MAX (1024ULL*1024*1024*4) /* default cache budget in bytes */
+
+/*
+ * Cached MRT stream of a parameter set.
+ */
+struct cache_entry_ {
+    char *key; /* hash of the parsed parameter set */
+    char *params; /* parameter set of the first request */
+
+    chunk_t *block; /* encoded blocks */
+    uint num_blocks;
+    uint max_blocks;
+    size_t bytes;
+
+    bool complete;
+    bool failed;
+    uint refcnt;
+
+    CIRCLEQ_ENTRY(cache_entry_) cache_qnode;
+};
+
+typedef struct cache_entry_ cache_entry_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    CIRCLEQ_HEAD(cache_head_, cache_entry_) cache_qhead;
+    size_t bytes;
+    size_t max_bytes;
+} server = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* getopt() is not reentrant */
+static pthread_mutex_t parse_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Free a cache entry. Must be called with the server mutex held.
+ */
+static void
+mrtgen_server_free_entry (cache_entry_t *entry)
+{
+    uint idx;
+
+    CIRCLEQ_REMOVE(&server.cache_qhead, entry, cache_qnode);
+    server.bytes -= entry->bytes;
+
+    for (idx = 0; idx < entry->num_blocks; idx++) {
+	free(entry->block[idx].buf);
+    }
+    free(entry->block);
+    free(entry->key);
+    free(entry->params);
+    free(entry);
+}
+
+/*
+ * Evict least recently used, unreferenced entries until another need bytes
+ * fit into the budget. Must be called with the server mutex held.
+ */
+static void
+mrtgen_server_evict (size_t need)
+{
+    cache_entry_t *entry, *next;
+
+    for (entry = CIRCLEQ_FIRST(&server.cache_qhead);
+	 entry != (void *)&server.cache_qhead; entry = next) {
+	next = CIRCLEQ_NEXT(entry, cache_qnode);
+
+	if (entry->refcnt || !entry->complete) {
+	    continue;
+	}
+	if (entry->failed || server.bytes + need > server.max_bytes) {
+	    LOG(IO, "Evict %lu bytes cache entry '%s'\n", (unsigned long)entry->bytes, entry->params);
+	    mrtgen_server_free_entry(entry);
+	}
+    }
+}
+
+/*
+ * Output sink of the generator. Append the flushed chunks to the cache entry
+ * and wake up the clients streaming it. An entry which does not fit
+ * into the budget fails, rather than growing the cache without bound.
+ */
+static int
+mrtgen_server_sink (ctx_t *ctx, struct iovec *iov, uint iov_cnt)
+{
+    cache_entry_t *entry;
+    chunk_t *block;
+    u_char *buf;
+    uint idx;
+
+    entry = ctx->sink_arg;
+
+    for (idx = 0; idx < iov_cnt; idx++) {
+	buf = malloc(iov[idx].iov_len);
+	if (!buf) {
+	    LOG(ERROR, "Could not allocate %zu bytes cache block\n", iov[idx].iov_len);
+	    return 1;
+	}
+	memcpy(buf, iov[idx].iov_base, iov[idx].iov_len);
+
+	pthread_mutex_lock(&server.mutex);
+	mrtgen_server_evict(iov[idx].iov_len);
+	if (entry->failed || server.bytes + iov[idx].iov_len > server.max_bytes) {
+	    if (!entry->failed) {
+		LOG(ERROR, "Cache budget of %zu bytes exceeded by '%s'\n", server.max_bytes, entry->params);
+	    }
+	    entry->failed = true;
+	    pthread_mutex_unlock(&server.mutex);
+	    free(buf);
+	    return 1;
+	}
+	if (entry->num_blocks == entry->max_blocks) {
+	    entry->max_blocks = entry->max_blocks ? entry->max_blocks * 2 : 64;
+	    block = realloc(entry->block, entry->max_blocks * sizeof(chunk_t));
+	    if (!block) {
+		pthread_mutex_unlock(&server.mutex);
+		free(buf);
+		LOG(ERROR, "Could not grow cache entry '%s'\n", entry->params);
+		return 1;
+	    }
+	    entry->block = block;
+	}
+	entry->block[entry->num_blocks].buf = buf;
+	entry->block[entry->num_blocks].idx = iov[idx].iov_len;
+	entry->num_blocks++;
+	entry->bytes += iov[idx].iov_len;
+	server.bytes += iov[idx].iov_len;
+	pthread_cond_broadcast(&server.cond);
+	pthread_mutex_unlock(&server.mutex);
+    }
+
+    return 0;
+}
+
+/*
+ * Split a parameter set into an argument vector and parse it.
+ * String parameters of the context point into the returned line.
+ * return the reason for rejecting the parameter set, NULL if it can be served.
+ */
+static const char *
+mrtgen_server_parse (const char *params, ctx_t *ctx, char **line)
+{
+    char *argv[SERVER_ARGS_MAX];
+    char *tok, *saveptr;
+    int argc, res;
+
+    mrtgen_init_ctx(ctx);
+    ctx->parse_restricted = true;
+    *line = strdup(params);
+    if (!*line) {
+	return "out of memory";
+    }
+    argc = 0;
+    argv[argc++] = "mrtgen";
+    for (tok = strtok_r(*line, " \t", &saveptr); tok && argc < SERVER_ARGS_MAX - 1;
+	 tok = strtok_r(NULL, " \t", &saveptr)) {
+	argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    pthread_mutex_lock(&parse_mutex);
+    res = mrtgen_parse_args(ctx, argc, argv);
+    pthread_mutex_unlock(&parse_mutex);
+
+    if (res != 0) {
+	return "invalid parameter set";
+    }
+
+    /*
+     * Only table shaping options. Everything else is either a mode which
+     * does not produce a cacheable stream or would get ignored.
+     */
+    if (ctx->input || ctx->delta_from || ctx->bgp_peer || ctx->server || ctx->server_cache ||
+	ctx->num_threads || ctx->num_cpus || ctx->cache_dir || ctx->manifest || ctx->direct ||
+	ctx->sweep_num || ctx->progress_interval || ctx->perf) {
+	return "only table shaping options are supported in server mode";
+    }
+    return NULL;
+}
+
+/*
+ * Cache key of a parsed parameter set, such that equivalent spellings share an entry.
+ */
+static void
+mrtgen_server_key (ctx_t *ctx, char *key, size_t size)
+{
+    snprintf(key, size, "%016llx.%u.%u:%u", (unsigned long long)mrtgen_cache_key(ctx),
+	     ctx->num_prefixes, ctx->seq_start, ctx->seq_end);
+}
+
+/*
+ * Generator thread. Fill a cache entry from its parameter set.
+ */
+static void *
+mrtgen_server_generate (void *arg)
+{
+    cache_entry_t *entry;
+    const char *reason;
+    char *line;
+    int res;
+    ctx_t ctx;
+
+    entry = arg;
+
+    reason = mrtgen_server_parse(entry->params, &ctx, &line);
+    res = reason ? -1 : 0;
+    if (res == 0) {
+	ctx.filename = entry->params;
+	ctx.direct = false;
+	ctx.sink = mrtgen_server_sink;
+	ctx.sink_arg = entry;
+
+	mrtgen_select_encoder(&ctx);
+	mrtgen_generate_rib(&ctx);
+	if (mrtgen_init_chunks(&ctx) == 0) {
+	    mrtgen_write_rib(&ctx);
+	    mrtgen_free_chunks(&ctx);
+	} else {
+	    res = -1;
+	}
+	mrtgen_delete_rib(&ctx);
+    } else {
+	LOG(ERROR, "Parameter set '%s': %s\n", entry->params, reason);
+    }
+    free(ctx.write_buf);
+    free(line);
+
+    pthread_mutex_lock(&server.mutex);
+    entry->complete = true;
+    entry->failed |= (res != 0);
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.mutex);
+
+    return NULL;
+}
+
+/*
+ * Write an entire block to the client socket.
+ */
+static int
+mrtgen_server_write (int fd, u_char *buf, size_t len)
+{
+    ssize_t res;
+
+    while (len) {
+	res = write(fd, buf, len);
+	if (res == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;
+	}
+	buf += res;
+	len -= res;
+    }
+    return 0;
+}
+
+/*
+ * Read the parameter set line of a client.
+ */
+static int
+mrtgen_server_read_line (int fd, char *line, size_t size)
+{
+    size_t len;
+    ssize_t res;
+
+    len = 0;
+    while (len < size - 1) {
+	res = read(fd, line + len, 1);
+	if (res == -1 && errno == EINTR) {
+	    continue;
+	}
+	if (res <= 0 || line[len] == '\n') {
+	    break;
+	}
+	len++;
+    }
+    line[len] = 0;
+
+    /* strip trailing whitespace */
+    while (len && (line[len-1] == '\r' || line[len-1] == ' ' || line[len-1] == '\t')) {
+	line[--len] = 0;
+    }
+
+    return len ? 0 : -1;
+}
+
+/*
+ * Reject a client request with an error line.
+ */
+static void
+mrtgen_server_reject (int fd, const char *line, const char *reason)
+{
+    char msg[SERVER_LINE_MAX];
+    int len;
+
+    LOG(ERROR, "Reject '%s': %s\n", line, reason);
+    len = snprintf(msg, sizeof(msg), "ERROR %s\n", reason);
+    mrtgen_server_write(fd, (u_char *)msg, len);
+    close(fd);
+}
+
+/*
+ * Connection thread. Lookup or create the cache entry of the requested
+ * parameter set and stream its blocks as they become available.
+ */
+static void *
+mrtgen_server_client (void *arg)
+{
+    cache_entry_t *entry;
+    char line[SERVER_LINE_MAX];
+    char key[64];
+    const char *reason;
+    char *parse_line;
+    pthread_t thread;
+    u_char *buf;
+    size_t len;
+    uint idx;
+    int fd;
+    ctx_t ctx;
+
+    fd = (int)(long)arg;
+
+    if (mrtgen_server_read_line(fd, line, sizeof(line)) != 0) {
+	close(fd);
+	return NULL;
+    }
+
+    /*
+     * Validate before admitting, such that the client learns why.
+     */
+    reason = mrtgen_server_parse(line, &ctx, &parse_line);
+    if (!reason) {
+	mrtgen_server_key(&ctx, key, sizeof(key));
+    }
+    free(ctx.write_buf);
+    free(ctx.sweep);
+    free(parse_line);
+    if (reason) {
+	mrtgen_server_reject(fd, line, reason);
+	return NULL;
+    }
+
+    /*
+     * Failed entries are on their way out, never serve them.
+     */
+    pthread_mutex_lock(&server.mutex);
+    CIRCLEQ_FOREACH(entry, &server.cache_qhead, cache_qnode) {
+	if (!entry->failed && strcmp(entry->key, key) == 0) {
+	    break;
+	}
+    }
+
+    if (entry != (void *)&server.cache_qhead) {
+
+	/* Cache hit, most recently used goes to the tail */
+	CIRCLEQ_REMOVE(&server.cache_qhead, entry, cache_qnode);
+	CIRCLEQ_INSERT_TAIL(&server.cache_qhead, entry, cache_qnode);
+	LOG(NORMAL, "Serve cached '%s'\n", line);
+    } else {
+	mrtgen_server_evict(0);
+	if (server.bytes >= server.max_bytes) {
+	    pthread_mutex_unlock(&server.mutex);
+	    mrtgen_server_reject(fd, line, "cache budget exhausted");
+	    return NULL;
+	}
+
+	entry = calloc(1, sizeof(cache_entry_t));
+	if (entry) {
+	    entry->key = strdup(key);
+	    entry->params = strdup(line);
+	}
+	if (!entry || !entry->key || !entry->params) {
+	    if (entry) {
+		free(entry->key);
+		free(entry->params);
+	    }
+	    free(entry);
+	    pthread_mutex_unlock(&server.mutex);
+	    LOG(ERROR, "Could not allocate cache entry\n");
+	    close(fd);
+	    return NULL;
+	}
+	CIRCLEQ_INSERT_TAIL(&server.cache_qhead, entry, cache_qnode);
+	LOG(NORMAL, "Generate '%s'\n", line);
+
+	if (pthread_create(&thread, NULL, mrtgen_server_generate, entry) != 0) {
+	    LOG(ERROR, "Could not create generator thread\n");
+	    entry->complete = true;
+	    entry->failed = true;
+	} else {
+	    pthread_detach(thread);
+	}
+    }
+    entry->refcnt++;
+
+    /*
+     * Stream the blocks.
+     */
+    idx = 0;
+    while (1) {
+	while (idx == entry->num_blocks && !entry->complete) {
+	    pthread_cond_wait(&server.cond, &server.mutex);
+	}
+	if (idx == entry->num_blocks) {
+	    break;
+	}
+	buf = entry->block[idx].buf;
+	len = entry->block[idx].idx;
+	idx++;
+
+	pthread_mutex_unlock(&server.mutex);
+	if (mrtgen_server_write(fd, buf, len) != 0) {
+	    LOG(IO, "write(): error %s (%d)\n", strerror(errno), errno);
+	    pthread_mutex_lock(&server.mutex);
+	    break;
+	}
+	pthread_mutex_lock(&server.mutex);
+    }
+
+    entry->refcnt--;
+    mrtgen_server_evict(0);
+    pthread_mutex_unlock(&server.mutex);
+
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Open the listen socket.
+ * A name containing a '/' is a UNIX socket path, anything else is [addr:]port.
+ */
+static int
+mrtgen_server_listen (char *name)
+{
+    struct sockaddr_un addr_un;
+    struct sockaddr_in addr_in;
+    char *port;
+    int fd, on;
+
+    if (strchr(name, '/')) {
+	memset(&addr_un, 0, sizeof(addr_un));
+	addr_un.sun_family = AF_UNIX;
+	strncpy(addr_un.sun_path, name, sizeof(addr_un.sun_path) - 1);
+	unlink(name);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&addr_un, sizeof(addr_un)) == -1) {
+	    goto error;
+	}
+    } else {
+	memset(&addr_in, 0, sizeof(addr_in));
+	addr_in.sin_family = AF_INET;
+	addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	port = strchr(name, ':');
+	if (port) {
+	    *port++ = 0;
+	    if (!inet_pton(AF_INET, name, &addr_in.sin_addr)) {
+		LOG(ERROR, "Invalid server address %s\n", name);
+		return -1;
+	    }
+	} else {
+	    port = name;
+	}
+	addr_in.sin_port = htons(atoi(port));
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	on = 1;
+	if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(fd, (struct sockaddr *)&addr_in, sizeof(addr_in)) == -1) {
+	    goto error;
+	}
+    }
+
+    if (listen(fd, 64) == -1) {
+	goto error;
+    }
+    return fd;
+
+ error:
+    LOG(ERROR, "Could not listen on %s: %s\n", name, strerror(errno));
+    if (fd != -1) {
+	close(fd);
+    }
+    return -1;
+}
+
+/*
+ * Server main loop. Never returns unless the listen socket fails.
+ */
+int
+mrtgen_server (ctx_t *ctx)
+{
+    pthread_t thread;
+    int fd, client_fd;
+
+    signal(SIGPIPE, SIG_IGN);
+    CIRCLEQ_INIT(&server.cache_qhead);
+    server.max_bytes = ctx->server_cache ? (size_t)ctx->server_cache * 1024 * 1024 : SERVER_CACHE_MAX;
+
+    fd = mrtgen_server_listen(ctx->server);
+    if (fd == -1) {
+	return -1;
+    }
+    LOG(NORMAL, "Server listening on %s, cache budget %zu MB\n", ctx->server, server.max_bytes / (1024 * 1024));
+
+    while (1) {
+	client_fd = accept(fd, NULL, NULL);
+	if (client_fd == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    LOG(ERROR, "accept(): error %s (%d)\n", strerror(errno), errno);
+	    break;
+	}
+
+	if (pthread_create(&thread, NULL, mrtgen_server_client, (void *)(long)client_fd) != 0) {
+	    LOG(ERROR, "Could not create client thread\n");
+	    close(client_fd);
+	    continue;
+	}
+	pthread_detach(thread);
+    }
+
+    close(fd);
+    return -1;
+}
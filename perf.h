@@ -0,0 +1,39 @@
+/*
+ * Generation of MRT files as input for bgpdump2 blaster.
+ *
+ * Hardware performance counters.
+ *
+ * Hannes Gredler, June 2021
+ *
+ * Copyright (C) 2015-2021, RtBrick, Inc.
+ */
+
+#include <stdint.h>
+
+/*
+ * List of counters.
+ */
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_COUNTER_MAX
+};
+
+/*
+ * Counter snapshot, or the difference of two.
+ */
+struct perf_sample_ {
+    uint64_t value[PERF_COUNTER_MAX];
+    uint64_t nsec; /* monotonic clock */
+};
+
+typedef struct perf_sample_ perf_sample_t;
+
+uint mrtgen_perf_open(void);
+void mrtgen_perf_close(void);
+void mrtgen_perf_read(perf_sample_t *);
+void mrtgen_perf_add(perf_sample_t *, perf_sample_t *, perf_sample_t *);
+char *mrtgen_perf_format(perf_sample_t *, uint64_t);